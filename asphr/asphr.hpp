@@ -33,7 +33,9 @@
 #include "absl/time/time.h"
 #include "assert.hpp"
 #include "log.hpp"
+#include "metrics.hpp"
 #include "third_party/json/nlohmann_json.h"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 
 using std::array;
@@ -0,0 +1,239 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "bit_pack.hpp"
+
+#include <bit>
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ASPHR_BIT_PACK_X86 1
+#include <immintrin.h>
+#endif
+
+namespace asphr {
+
+namespace {
+
+inline auto low_mask(int bits) -> uint64_t {
+  return bits == 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+}
+
+inline auto load_be64(const unsigned char* p) -> uint64_t {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  if constexpr (std::endian::native == std::endian::little) {
+    v = __builtin_bswap64(v);
+  }
+  return v;
+}
+
+inline auto store_be64(unsigned char* p, uint64_t v) -> void {
+  if constexpr (std::endian::native == std::endian::little) {
+    v = __builtin_bswap64(v);
+  }
+  std::memcpy(p, &v, sizeof(v));
+}
+
+// reads the bits bits starting at bit offset of in, one byte at a time. only
+// used at the end of the input, where a full 8-byte load would overrun it.
+inline auto read_bits_bytewise(std::span<const unsigned char> in, size_t offset,
+                               int bits) -> uint64_t {
+  unsigned __int128 acc = 0;
+  const size_t first = offset / 8;
+  const size_t last = (offset + bits + 7) / 8;
+  for (size_t i = first; i < last; i++) {
+    acc = (acc << 8) | in[i];
+  }
+  const auto trailing = static_cast<int>(last * 8 - offset - bits);
+  return static_cast<uint64_t>(acc >> trailing) & low_mask(bits);
+}
+
+// the inverse of pack_lsb_bits: it refills acc 64 bits at a time.
+auto unpack_portable(std::span<const unsigned char> in, int bits,
+                     std::span<uint64_t> values) -> void {
+  const uint64_t mask = low_mask(bits);
+  unsigned __int128 acc = 0;
+  int available = 0;
+  size_t position = 0;
+  for (auto& v : values) {
+    if (available < bits) {
+      if (position + 8 <= in.size()) {
+        acc = (acc << 64) | load_be64(in.data() + position);
+        position += 8;
+        available += 64;
+      } else {
+        while (available < bits) {
+          acc = (acc << 8) | in[position++];
+          available += 8;
+        }
+      }
+    }
+    available -= bits;
+    v = static_cast<uint64_t>(acc >> available) & mask;
+  }
+}
+
+#ifdef ASPHR_BIT_PACK_X86
+
+// reads values [begin, values.size()), one independent load per value
+__attribute__((target("bmi2"))) auto unpack_bmi2_from(
+    std::span<const unsigned char> in, int bits, std::span<uint64_t> values,
+    size_t begin) -> void {
+  // a value starts at most 7 bits into its first byte, so an 8-byte load
+  // covers it if bits <= 57.
+  if (bits > 57) {
+    for (size_t i = begin; i < values.size(); i++) {
+      values[i] = read_bits_bytewise(in, i * bits, bits);
+    }
+    return;
+  }
+  size_t i = begin;
+  for (; i < values.size(); i++) {
+    const size_t offset = i * bits;
+    if (offset / 8 + 8 > in.size()) {
+      break;
+    }
+    const auto word = load_be64(in.data() + offset / 8);
+    values[i] =
+        _bzhi_u64(word >> (64 - static_cast<int>(offset % 8) - bits), bits);
+  }
+  for (; i < values.size(); i++) {
+    values[i] = read_bits_bytewise(in, i * bits, bits);
+  }
+}
+
+__attribute__((target("bmi2"))) auto unpack_bmi2(
+    std::span<const unsigned char> in, int bits, std::span<uint64_t> values)
+    -> void {
+  unpack_bmi2_from(in, bits, values, 0);
+}
+
+__attribute__((target("avx2,bmi2"))) auto unpack_avx2(
+    std::span<const unsigned char> in, int bits, std::span<uint64_t> values)
+    -> void {
+  size_t i = 0;
+  if (bits <= 57) {
+    // reverses the bytes of every 64-bit lane
+    const __m256i bswap = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,  //
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i lane_offsets =
+        _mm256_setr_epi64x(0, bits, 2 * bits, 3 * bits);
+    const __m256i mask =
+        _mm256_set1_epi64x(static_cast<int64_t>(low_mask(bits)));
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i base_shift = _mm256_set1_epi64x(64 - bits);
+    const auto* data = reinterpret_cast<const long long*>(in.data());
+    // the last of the 4 lanes must be able to load 8 bytes
+    for (; i + 4 <= values.size() && ((i + 3) * bits) / 8 + 8 <= in.size();
+         i += 4) {
+      const __m256i offsets = _mm256_add_epi64(
+          _mm256_set1_epi64x(static_cast<int64_t>(i * bits)), lane_offsets);
+      __m256i words = _mm256_i64gather_epi64(
+          data, _mm256_srli_epi64(offsets, 3), 1);
+      words = _mm256_shuffle_epi8(words, bswap);
+      const __m256i shifts =
+          _mm256_sub_epi64(base_shift, _mm256_and_si256(offsets, seven));
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i*>(values.data() + i),
+          _mm256_and_si256(_mm256_srlv_epi64(words, shifts), mask));
+    }
+  }
+  unpack_bmi2_from(in, bits, values, i);
+}
+
+#endif  // ASPHR_BIT_PACK_X86
+
+auto best_unpack_kernel() -> BitPackKernel {
+  static const auto kernel = [] {
+    for (auto k : {BitPackKernel::avx2, BitPackKernel::bmi2}) {
+      if (bit_pack_kernel_supported(k)) {
+        return k;
+      }
+    }
+    return BitPackKernel::portable;
+  }();
+  return kernel;
+}
+
+}  // namespace
+
+auto bit_pack_kernel_supported(BitPackKernel kernel) -> bool {
+  switch (kernel) {
+    case BitPackKernel::portable:
+      return true;
+#ifdef ASPHR_BIT_PACK_X86
+    case BitPackKernel::bmi2:
+      return __builtin_cpu_supports("bmi2");
+    case BitPackKernel::avx2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+#else
+    case BitPackKernel::bmi2:
+    case BitPackKernel::avx2:
+      return false;
+#endif
+  }
+  return false;
+}
+
+auto unpack_lsb_bits(BitPackKernel kernel, std::span<const unsigned char> in,
+                     int bits, std::span<uint64_t> values) -> void {
+  assert(bits >= 1 && bits <= 64);
+  assert(in.size() >= packed_size(values.size(), bits));
+  assert(bit_pack_kernel_supported(kernel));
+  switch (kernel) {
+    case BitPackKernel::portable:
+      unpack_portable(in, bits, values);
+      return;
+#ifdef ASPHR_BIT_PACK_X86
+    case BitPackKernel::bmi2:
+      unpack_bmi2(in, bits, values);
+      return;
+    case BitPackKernel::avx2:
+      unpack_avx2(in, bits, values);
+      return;
+#else
+    default:
+      unpack_portable(in, bits, values);
+      return;
+#endif
+  }
+}
+
+// keeps the bits that have not been written yet in the low bits of acc, and
+// writes them out 64 at a time.
+auto pack_lsb_bits(std::span<const uint64_t> values, int bits,
+                   std::span<unsigned char> out) -> void {
+  assert(bits >= 1 && bits <= 64);
+  assert(out.size() >= packed_size(values.size(), bits));
+  const uint64_t mask = low_mask(bits);
+  unsigned __int128 acc = 0;
+  int filled = 0;
+  size_t position = 0;
+  for (const auto v : values) {
+    acc = (acc << bits) | (v & mask);
+    filled += bits;
+    if (filled >= 64) {
+      filled -= 64;
+      store_be64(out.data() + position, static_cast<uint64_t>(acc >> filled));
+      position += 8;
+    }
+  }
+  if (filled > 0) {
+    const auto rest = static_cast<uint64_t>(acc) << (64 - filled);
+    for (int i = 0; i < filled; i += 8) {
+      out[position++] = static_cast<unsigned char>(rest >> (56 - i));
+    }
+  }
+}
+
+auto unpack_lsb_bits(std::span<const unsigned char> in, int bits,
+                     std::span<uint64_t> values) -> void {
+  unpack_lsb_bits(best_unpack_kernel(), in, bits, values);
+}
+
+}  // namespace asphr
@@ -0,0 +1,54 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace asphr {
+
+// The number of bytes pack_lsb_bits writes for count values of bits bits each.
+constexpr auto packed_size(size_t count, int bits) -> size_t {
+  return (count * static_cast<size_t>(bits) + 7) / 8;
+}
+
+// pack_lsb_bits packs the bits least significant bits of every value into out,
+// msb first: the first value ends up in the high bits of out[0]. This is the
+// format of concat_N_lsb_bits. out must hold at least
+// packed_size(values.size(), bits) bytes, and the unused low bits of the last
+// byte are set to 0. bits must be in [1, 64].
+//
+// unpack_lsb_bits is the inverse: it reads values.size() values of bits bits
+// each from in, which must hold at least packed_size(values.size(), bits)
+// bytes.
+//
+// unpack_lsb_bits picks the fastest kernel the cpu supports, once, at runtime.
+// pack_lsb_bits has only the portable kernel: every value sits in its own
+// 64-bit word, so there is nothing for pext or wider vectors to gather.
+auto pack_lsb_bits(std::span<const uint64_t> values, int bits,
+                   std::span<unsigned char> out) -> void;
+auto unpack_lsb_bits(std::span<const unsigned char> in, int bits,
+                     std::span<uint64_t> values) -> void;
+
+// the kernels behind unpack_lsb_bits, for tests and benchmarks. a kernel may
+// only be used if bit_pack_kernel_supported says so.
+enum class BitPackKernel {
+  // word at a time, in plain C++
+  portable,
+  // BMI2: reads every value with its own unaligned load and extracts it with
+  // bzhi, so there is no dependency between values.
+  bmi2,
+  // AVX2: gathers and shifts 4 values at a time.
+  avx2,
+};
+
+auto bit_pack_kernel_supported(BitPackKernel kernel) -> bool;
+
+auto unpack_lsb_bits(BitPackKernel kernel, std::span<const unsigned char> in,
+                     int bits, std::span<uint64_t> values) -> void;
+
+}  // namespace asphr
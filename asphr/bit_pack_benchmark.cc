@@ -0,0 +1,71 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <vector>
+
+#include "bit_pack.hpp"
+#include "utils.hpp"
+
+using namespace asphr;
+
+namespace {
+// one decoded answer: a full slot vector of 18-bit coefficients
+constexpr size_t COUNT = 4096;
+constexpr int BITS = 18;
+
+auto random_values() -> std::vector<uint64_t> {
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> values(COUNT);
+  for (auto& v : values) {
+    v = rng() & ((uint64_t{1} << BITS) - 1);
+  }
+  return values;
+}
+
+void BM_Pack(benchmark::State& state) {
+  const auto values = random_values();
+  std::vector<unsigned char> out(packed_size(COUNT, BITS));
+  for (auto _ : state) {
+    pack_lsb_bits(values, BITS, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * COUNT);
+}
+
+void BM_Unpack(benchmark::State& state) {
+  const auto kernel = static_cast<BitPackKernel>(state.range(0));
+  if (!bit_pack_kernel_supported(kernel)) {
+    state.SkipWithError("kernel not supported on this cpu");
+    return;
+  }
+  const auto values = random_values();
+  std::vector<unsigned char> packed(packed_size(COUNT, BITS));
+  pack_lsb_bits(values, BITS, packed);
+  std::vector<uint64_t> out(COUNT);
+  for (auto _ : state) {
+    unpack_lsb_bits(kernel, packed, BITS, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * COUNT);
+}
+
+// the implementation this replaces
+void BM_ConcatNLsbBits(benchmark::State& state) {
+  const auto values = random_values();
+  for (auto _ : state) {
+    auto out = concat_N_lsb_bits<BITS>(values);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * COUNT);
+}
+}  // namespace
+
+BENCHMARK(BM_Pack);
+// the argument is the BitPackKernel: portable, bmi2, avx2
+BENCHMARK(BM_Unpack)->DenseRange(0, 2);
+BENCHMARK(BM_ConcatNLsbBits);
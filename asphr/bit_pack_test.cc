@@ -0,0 +1,72 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "bit_pack.hpp"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "utils.hpp"
+
+using namespace asphr;
+
+namespace {
+const BitPackKernel ALL_KERNELS[] = {
+    BitPackKernel::portable, BitPackKernel::bmi2, BitPackKernel::avx2};
+
+auto random_values(size_t count, std::mt19937_64& rng) -> vector<uint64_t> {
+  vector<uint64_t> values(count);
+  for (auto& v : values) {
+    v = rng();
+  }
+  return values;
+}
+
+auto mask(int bits) -> uint64_t {
+  return bits == 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+}
+}  // namespace
+
+TEST(BitPack, MatchesConcatNLsbBits) {
+  vector<uint64_t> in = {0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8};
+  vector<unsigned char> out(packed_size(in.size(), 3));
+  pack_lsb_bits(in, 3, out);
+  EXPECT_EQ(out, vector<unsigned char>({0b00101001, 0b11001011, 0b10111000}));
+}
+
+TEST(BitPack, PadsTheLastByteWithZeros) {
+  vector<uint64_t> in = {0b111, 0b111, 0b111};
+  vector<unsigned char> out(packed_size(in.size(), 3), 0xFF);
+  pack_lsb_bits(in, 3, out);
+  EXPECT_EQ(out, vector<unsigned char>({0xFF, 0b10000000}));
+}
+
+TEST(BitPack, RoundTripAllWidthsAndKernels) {
+  std::mt19937_64 rng(42);
+  // odd counts, so that the tails of every kernel are covered
+  for (size_t count : {size_t{0}, size_t{1}, size_t{7}, size_t{101}}) {
+    for (int bits = 1; bits <= 64; bits++) {
+      const auto values = random_values(count, rng);
+      vector<uint64_t> expected(values);
+      for (auto& v : expected) {
+        v &= mask(bits);
+      }
+
+      vector<unsigned char> packed(packed_size(count, bits));
+      pack_lsb_bits(values, bits, packed);
+
+      for (auto kernel : ALL_KERNELS) {
+        if (!bit_pack_kernel_supported(kernel)) {
+          continue;
+        }
+        vector<uint64_t> unpacked(count);
+        unpack_lsb_bits(kernel, packed, bits, unpacked);
+        EXPECT_EQ(unpacked, expected) << "bits " << bits;
+      }
+    }
+  }
+}
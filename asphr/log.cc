@@ -0,0 +1,319 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace asphr {
+namespace {
+// loading the time zone reads the tz database, so we only do it once
+auto local_time_zone() -> const absl::TimeZone& {
+  static const absl::TimeZone tz = absl::LocalTimeZone();
+  return tz;
+}
+
+std::atomic<LogFormat> log_format = LogFormat::text;
+
+auto append_json_string(std::string& out, absl::string_view s) -> void {
+  out += '"';
+  for (const char c : s) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          constexpr char hex[] = "0123456789abcdef";
+          out += "\\u00";
+          out += hex[c >> 4];
+          out += hex[c & 0xf];
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+}
+
+// everything after the timestamp. this is the part that is formatted in the
+// thread that logs.
+auto format_body(LogFormat format, const char* file, int line,
+                 const char* level, const absl::AlphaNum& msg,
+                 std::initializer_list<absl::AlphaNum> fields) -> std::string {
+  std::string out;
+  if (format == LogFormat::text) {
+    absl::StrAppend(&out, " ", file, ":", line, " ", level, "] ", msg);
+    for (auto it = fields.begin(); it != fields.end(); it += 2) {
+      absl::StrAppend(&out, " ", *it, "=", *(it + 1));
+    }
+    out += "\n";
+    return out;
+  }
+  absl::StrAppend(&out, ",\"file\":");
+  append_json_string(out, file);
+  absl::StrAppend(&out, ",\"line\":", line, ",\"level\":\"", level,
+                  "\",\"msg\":");
+  append_json_string(out, msg.Piece());
+  for (auto it = fields.begin(); it != fields.end(); it += 2) {
+    out += ',';
+    append_json_string(out, it->Piece());
+    out += ':';
+    append_json_string(out, (it + 1)->Piece());
+  }
+  out += "}\n";
+  return out;
+}
+
+auto format_line(absl::Time time, LogFormat format, const std::string& body)
+    -> std::string {
+  const auto t = absl::FormatTime("%Y-%m-%d%ET%H:%M:%E2S%Ez", time,
+                                  local_time_zone());
+  if (format == LogFormat::text) {
+    return absl::StrCat("[", t, body);
+  }
+  return absl::StrCat("{\"time\":\"", t, "\"", body);
+}
+
+struct Entry {
+  absl::Time time;
+  LogFormat format;
+  std::string body;
+};
+
+// a single-producer single-consumer ring buffer of log lines. the producer is
+// the thread that owns it, the consumer is whoever holds the drain mutex.
+class LogRing {
+ public:
+  explicit LogRing(size_t capacity)
+      : entries(std::bit_ceil(std::max<size_t>(capacity, 1))),
+        mask(entries.size() - 1) {}
+
+  // returns false if the ring is full
+  auto push(absl::Time time, LogFormat format, std::string& body) -> bool {
+    const auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == entries.size()) {
+      return false;
+    }
+    entries[t & mask] = Entry{time, format, std::move(body)};
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  auto drain(std::vector<Entry>& out) -> void {
+    const auto h = head.load(std::memory_order_relaxed);
+    const auto t = tail.load(std::memory_order_acquire);
+    for (auto i = h; i != t; i++) {
+      out.push_back(std::move(entries[i & mask]));
+    }
+    head.store(t, std::memory_order_release);
+  }
+
+  auto empty() const -> bool {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+  std::atomic<uint64_t> dropped = 0;
+
+ private:
+  std::vector<Entry> entries;
+  const size_t mask;
+  // head and tail only ever grow
+  alignas(64) std::atomic<size_t> head = 0;
+  alignas(64) std::atomic<size_t> tail = 0;
+};
+
+// the state of async logging. it is never destroyed, so that threads that
+// still log during static destruction do not touch a dead object.
+class AsyncLogger {
+ public:
+  auto start(AsyncLogOptions new_options) -> void {
+    std::lock_guard<std::mutex> l(control_mutex);
+    if (writer.joinable()) {
+      return;
+    }
+    if (!started) {
+      options = new_options;
+      started = true;
+    }
+    running.store(true);
+    enabled.store(true);
+    writer = std::thread([this] { writer_loop(); });
+  }
+
+  auto stop() -> void {
+    std::lock_guard<std::mutex> l(control_mutex);
+    if (!writer.joinable()) {
+      return;
+    }
+    // new lines go to stderr directly. the writer keeps draining until the
+    // threads that were already pushing are done.
+    enabled.store(false);
+    running.store(false);
+    writer.join();
+  }
+
+  // returns false if async logging is off, in which case the caller writes the
+  // line itself
+  auto write(absl::Time time, LogFormat format, std::string& body) -> bool {
+    if (!enabled.load()) {
+      return false;
+    }
+    in_flight.fetch_add(1);
+    // stop may have come in between, in which case the writer may not wait for
+    // us
+    if (!enabled.load()) {
+      in_flight.fetch_sub(1);
+      return false;
+    }
+    auto& ring = thread_ring();
+    while (!ring.push(time, format, body)) {
+      if (options.overflow == LogOverflow::drop) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+      std::this_thread::yield();
+    }
+    in_flight.fetch_sub(1);
+    return true;
+  }
+
+  auto flush() -> void { drain(); }
+
+ private:
+  std::mutex control_mutex;
+  std::thread writer;
+  // set by the first start, and never changed after, since the logging
+  // threads read it without a lock. they only read it once enabled is set,
+  // which orders the read after the write. the rings of the threads that
+  // logged before outlive a stop anyway, so new options could not apply to
+  // them.
+  AsyncLogOptions options;
+  bool started = false;
+  std::atomic<bool> enabled = false;
+  std::atomic<bool> running = false;
+  // number of threads inside write
+  std::atomic<size_t> in_flight = 0;
+
+  // the rings of all threads that have logged asynchronously. a ring outlives
+  // its thread until it has been drained.
+  std::mutex rings_mutex;
+  std::vector<std::shared_ptr<LogRing>> rings;
+
+  // only one thread drains at a time
+  std::mutex drain_mutex;
+
+  auto thread_ring() -> LogRing& {
+    thread_local std::shared_ptr<LogRing> ring;
+    if (ring == nullptr) {
+      ring = std::make_shared<LogRing>(options.buffer_lines);
+      std::lock_guard<std::mutex> l(rings_mutex);
+      rings.push_back(ring);
+    }
+    return *ring;
+  }
+
+  auto writer_loop() -> void {
+    while (running.load() || in_flight.load() > 0) {
+      if (!drain()) {
+        absl::SleepFor(options.flush_interval);
+      }
+    }
+    drain();
+  }
+
+  // writes out the lines in all rings. returns false if there were none.
+  auto drain() -> bool {
+    std::lock_guard<std::mutex> l(drain_mutex);
+    std::vector<std::shared_ptr<LogRing>> snapshot;
+    {
+      std::lock_guard<std::mutex> rl(rings_mutex);
+      // the rings of threads that have exited can go once they are empty
+      std::erase_if(rings, [](const auto& ring) {
+        return ring.use_count() == 1 && ring->empty();
+      });
+      snapshot = rings;
+    }
+
+    std::vector<Entry> entries;
+    uint64_t dropped = 0;
+    for (const auto& ring : snapshot) {
+      ring->drain(entries);
+      dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    if (entries.empty() && dropped == 0) {
+      return false;
+    }
+    // every ring is in order, but the threads are interleaved
+    std::stable_sort(
+        entries.begin(), entries.end(),
+        [](const Entry& a, const Entry& b) { return a.time < b.time; });
+
+    std::string out;
+    for (const auto& entry : entries) {
+      out += format_line(entry.time, entry.format, entry.body);
+    }
+    if (dropped > 0) {
+      const auto format = log_format.load(std::memory_order_relaxed);
+      out += format_line(absl::Now(), format,
+                         format_body(format, __FILE__, __LINE__, "WARN",
+                                     "Dropped log lines.", {"count", dropped}));
+    }
+    std::cerr.write(out.data(), static_cast<std::streamsize>(out.size()));
+    std::cerr.flush();
+    return true;
+  }
+};
+
+auto async_logger() -> AsyncLogger& {
+  static auto* logger = new AsyncLogger();
+  return *logger;
+}
+}  // namespace
+
+auto start_async_logging(AsyncLogOptions options) -> void {
+  async_logger().start(options);
+}
+
+auto stop_async_logging() -> void { async_logger().stop(); }
+
+auto flush_log() -> void { async_logger().flush(); }
+
+auto set_log_format(LogFormat format) -> void {
+  log_format.store(format, std::memory_order_relaxed);
+}
+
+namespace log_internal {
+auto write(absl::Time time, const char* file, int line, const char* level,
+           const absl::AlphaNum& msg,
+           std::initializer_list<absl::AlphaNum> fields) -> void {
+  const auto format = log_format.load(std::memory_order_relaxed);
+  auto body = format_body(format, file, line, level, msg, fields);
+  if (async_logger().write(time, format, body)) {
+    return;
+  }
+  const auto s = format_line(time, format, body);
+  std::cerr << s;
+  std::cerr.flush();
+}
+}  // namespace log_internal
+}  // namespace asphr
@@ -5,7 +5,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
 #include <iostream>
+#include <string>
 
 #include "absl/strings/str_cat.h"
 #include "absl/time/clock.h"
@@ -34,6 +39,26 @@ wins.
 
 We log to stderr only.
 
+By default, every log line is formatted and written to stderr in the calling
+thread, and stderr is flushed. Programs that log on hot paths can instead call
+asphr::start_async_logging, after which the calling thread only formats the
+line and appends it to a ring buffer of its own. A background thread drains
+the buffers, and writes the lines out in batches, in timestamp order. When a
+thread's buffer is full, the line is either dropped (and the drops reported) or
+the thread waits for the writer, see AsyncLogOptions. Lines that are still in
+the buffers when the program crashes are lost, so call asphr::flush_log before
+aborting on purpose.
+
+Lines are text by default. asphr::set_log_format(asphr::LogFormat::json)
+switches to one JSON object per line instead, with the timestamp, file, line,
+level and message, and the key/value pairs as string fields, e.g.
+  {"time":"...","file":"a.cc","line":12,"level":"INFO","msg":"hi.","key":"1"}
+
+Logging inside loops can be sampled per call site, see ASPHR_LOG_EVERY_N,
+ASPHR_LOG_FIRST_N and ASPHR_LOG_EVERY below. The sampling costs one atomic
+operation on a counter of the call site, and the skipped lines are never
+formatted.
+
 Log level is set at compile time:
 - ASPHR_LOGLEVEL_NONE: log nothing
 - ASPHR_LOGLEVEL_ERR: log only errors
@@ -49,6 +74,15 @@ Default is ASPHR_LOGLEVEL_DBG.
 // ASPHR_LOG_WARN(msg, key, value, key, value, ...)
 // ASPHR_LOG_INFO(msg, key, value, key, value, ...)
 // ASPHR_LOG_DBG(msg, key, value, key, value, ...)
+//
+// and, where level is ERR, WARN, INFO or DBG:
+//
+// logs the 1st, (n+1)th, (2n+1)th, ... time the call site is reached
+// ASPHR_LOG_EVERY_N(level, n, msg, key, value, ...)
+// logs the first n times the call site is reached
+// ASPHR_LOG_FIRST_N(level, n, msg, key, value, ...)
+// logs at most once per interval, an absl::Duration
+// ASPHR_LOG_EVERY(level, interval, msg, key, value, ...)
 
 #if !defined(ASPHR_LOGLEVEL_NONE) && !defined(ASPHR_LOGLEVEL_ERR) &&  \
     !defined(ASPHR_LOGLEVEL_WARN) && !defined(ASPHR_LOGLEVEL_INFO) && \
@@ -56,48 +90,144 @@ Default is ASPHR_LOGLEVEL_DBG.
 #define ASPHR_LOGLEVEL_DBG
 #endif
 
-#define ASPHR_EXPAND_LABEL(x) absl::StrCat(" ", #x, "=")
+namespace asphr {
+// what a thread does when its async log buffer is full
+enum class LogOverflow {
+  // drop the line. the writer reports how many lines were dropped.
+  drop,
+  // wait for the writer to make room
+  block,
+};
+
+struct AsyncLogOptions {
+  // per thread
+  size_t buffer_lines = 4096;
+  LogOverflow overflow = LogOverflow::drop;
+  // how long the writer sleeps when there is nothing to write
+  absl::Duration flush_interval = absl::Milliseconds(10);
+};
+
+// starts the background writer. lines logged from then on are written
+// asynchronously. does nothing if the writer is already running. the options
+// of the first call stay in effect for the life of the process, so starting
+// again after stop_async_logging ignores options.
+auto start_async_logging(AsyncLogOptions options = {}) -> void;
+
+// writes out all lines and goes back to logging synchronously
+auto stop_async_logging() -> void;
+
+// writes out all lines logged so far. does nothing when logging synchronously.
+auto flush_log() -> void;
+
+enum class LogFormat {
+  // [time file:line level] msg key=value ...
+  text,
+  // one JSON object per line
+  json,
+};
+
+auto set_log_format(LogFormat format) -> void;
+
+namespace log_internal {
+// fields alternates keys and values
+auto write(absl::Time time, const char* file, int line, const char* level,
+           const absl::AlphaNum& msg,
+           std::initializer_list<absl::AlphaNum> fields) -> void;
+
+inline auto every_n(std::atomic<uint64_t>& count, uint64_t n) -> bool {
+  return count.fetch_add(1, std::memory_order_relaxed) % n == 0;
+}
+
+inline auto first_n(std::atomic<uint64_t>& count, uint64_t n) -> bool {
+  // the load keeps the call site from writing to the counter forever
+  return count.load(std::memory_order_relaxed) < n &&
+         count.fetch_add(1, std::memory_order_relaxed) < n;
+}
+
+// next is the time in nanoseconds from which on the call site may log again
+inline auto every(std::atomic<int64_t>& next, absl::Duration interval)
+    -> bool {
+  const auto now = absl::GetCurrentTimeNanos();
+  auto expected = next.load(std::memory_order_relaxed);
+  return now >= expected &&
+         next.compare_exchange_strong(
+             expected, now + absl::ToInt64Nanoseconds(interval),
+             std::memory_order_relaxed);
+}
+}  // namespace log_internal
+}  // namespace asphr
+
+#define ASPHR_EXPAND_LABEL(x) #x
 #define ASPHR_EXPAND_VALUE(x) x
-#define ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, level, ...)                  \
-  {                                                                        \
-    absl::Time t1 = absl::Now();                                           \
-    auto s = absl::StrCat(                                                 \
-        "[",                                                               \
-        absl::FormatTime("%Y-%m-%d%ET%H:%M:%E2S%Ez", t1,                   \
-                         absl::LocalTimeZone()),                           \
-        " ", __FILE__, ":", __LINE__, " ", level, "] ", msg,               \
-        __VA_OPT__(ASPHR_FOR_EACH2(ASPHR_EXPAND_LABEL, ASPHR_EXPAND_VALUE, \
-                                   __VA_ARGS__), ) "\n");                  \
-    std::cerr << s;                                                        \
-    std::cerr.flush();                                                     \
+#define ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, level, ...)                   \
+  {                                                                         \
+    absl::Time t1 = absl::Now();                                            \
+    asphr::log_internal::write(                                             \
+        t1, __FILE__, __LINE__, level, msg,                                 \
+        {__VA_OPT__(ASPHR_FOR_EACH2(ASPHR_EXPAND_LABEL, ASPHR_EXPAND_VALUE, \
+                                    __VA_ARGS__))});                        \
   }
 
 #if defined(ASPHR_LOGLEVEL_ERR) || defined(ASPHR_LOGLEVEL_WARN) || \
     defined(ASPHR_LOGLEVEL_INFO) || defined(ASPHR_LOGLEVEL_DBG)
 #define ASPHR_LOG_ERR(msg, ...) \
   ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, "ERR", __VA_ARGS__)
+#define ASPHR_LOG_IF_ENABLED_ERR(...) __VA_ARGS__
 #else
 #define ASPHR_LOG_ERR(msg, ...) static_cast<void>(0)
+#define ASPHR_LOG_IF_ENABLED_ERR(...) static_cast<void>(0)
 #endif
 
 #if defined(ASPHR_LOGLEVEL_WARN) || defined(ASPHR_LOGLEVEL_INFO) || \
     defined(ASPHR_LOGLEVEL_DBG)
 #define ASPHR_LOG_WARN(msg, ...) \
   ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, "WARN", __VA_ARGS__)
+#define ASPHR_LOG_IF_ENABLED_WARN(...) __VA_ARGS__
 #else
 #define ASPHR_LOG_WARN(msg, ...) static_cast<void>(0)
+#define ASPHR_LOG_IF_ENABLED_WARN(...) static_cast<void>(0)
 #endif
 
 #if defined(ASPHR_LOGLEVEL_INFO) || defined(ASPHR_LOGLEVEL_DBG)
 #define ASPHR_LOG_INFO(msg, ...) \
   ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, "INFO", __VA_ARGS__)
+#define ASPHR_LOG_IF_ENABLED_INFO(...) __VA_ARGS__
 #else
 #define ASPHR_LOG_INFO(msg, ...) static_cast<void>(0)
+#define ASPHR_LOG_IF_ENABLED_INFO(...) static_cast<void>(0)
 #endif
 
 #if defined(ASPHR_LOGLEVEL_DBG)
 #define ASPHR_LOG_DBG(msg, ...) \
   ASPHR_DO_LOG_INTERNAL_DO_NOT_USE(msg, "DBG", __VA_ARGS__)
+#define ASPHR_LOG_IF_ENABLED_DBG(...) __VA_ARGS__
 #else
 #define ASPHR_LOG_DBG(msg, ...) static_cast<void>(0)
+#define ASPHR_LOG_IF_ENABLED_DBG(...) static_cast<void>(0)
 #endif
+
+// the sampled variants keep their counter in a static at the call site. at
+// levels that are compiled out, the counter is too, so they cost nothing.
+#define ASPHR_LOG_EVERY_N(level, n, msg, ...)                               \
+  ASPHR_LOG_IF_ENABLED_##level({                                            \
+    static std::atomic<uint64_t> asphr_log_count = 0;                       \
+    if (asphr::log_internal::every_n(asphr_log_count, (n))) {               \
+      ASPHR_LOG_##level(msg, __VA_ARGS__);                                  \
+    }                                                                       \
+  })
+
+#define ASPHR_LOG_FIRST_N(level, n, msg, ...)                               \
+  ASPHR_LOG_IF_ENABLED_##level({                                            \
+    static std::atomic<uint64_t> asphr_log_count = 0;                       \
+    if (asphr::log_internal::first_n(asphr_log_count, (n))) {               \
+      ASPHR_LOG_##level(msg, __VA_ARGS__);                                  \
+    }                                                                       \
+  })
+
+#define ASPHR_LOG_EVERY(level, interval, msg, ...)                          \
+  ASPHR_LOG_IF_ENABLED_##level({                                            \
+    static std::atomic<int64_t> asphr_log_next = 0;                         \
+    if (asphr::log_internal::every(asphr_log_next, (interval))) {           \
+      ASPHR_LOG_##level(msg, __VA_ARGS__);                                  \
+    }                                                                       \
+  })
@@ -6,6 +6,8 @@
 #include <cstdlib>  // std::exit
 #include <format>
 #include <iostream>  // std::cerr
+#include <thread>
+#include <vector>
 
 #include "log.hpp"
 
@@ -14,5 +16,34 @@ int main(int argc, char** argv) {
   ASPHR_LOG_WARN("warning.", key, "value", key2, 2);
   ASPHR_LOG_INFO("info.", info1, "value1");
   ASPHR_LOG_DBG("debug.", c++ version, "c++20", key2, 2, key3, 3);
+
+  // the same lines, and a burst from a few threads that overflows their
+  // buffers, through the async writer
+  asphr::start_async_logging({.buffer_lines = 64});
+  ASPHR_LOG_ERR("async error.", key, "value");
+  ASPHR_LOG_INFO("async info.", info1, "value1");
+  {
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([t] {
+        for (int i = 0; i < 1000; i++) {
+          ASPHR_LOG_DBG("async burst.", thread, t, i, i);
+        }
+      });
+    }
+  }
+  asphr::stop_async_logging();
+  ASPHR_LOG_INFO("back to sync.");
+
+  // 0, 3, 6 and 9, then 0 and 1, then 0 and probably nothing else
+  for (int i = 0; i < 10; i++) {
+    ASPHR_LOG_EVERY_N(INFO, 3, "every 3rd.", i, i);
+    ASPHR_LOG_FIRST_N(INFO, 2, "first 2.", i, i);
+    ASPHR_LOG_EVERY(INFO, absl::Seconds(1), "at most once a second.", i, i);
+  }
+
+  asphr::set_log_format(asphr::LogFormat::json);
+  ASPHR_LOG_INFO("json.", key, "needs \"escaping\"\n", number, 2);
+  ASPHR_LOG_EVERY_N(WARN, 10, "sampled json.");
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,192 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "metrics.hpp"
+
+#include <bit>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+#include "absl/strings/str_cat.h"
+#include "third_party/json/nlohmann_json.h"
+
+namespace asphr {
+namespace {
+// the metrics are never destroyed, so that they can be used during static
+// destruction, and so that the references handed out stay valid
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<Counter>> counters;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms;
+};
+
+auto registry() -> Registry& {
+  static auto* r = new Registry();
+  return *r;
+}
+}  // namespace
+
+auto Counter::value() const -> uint64_t {
+  uint64_t total = 0;
+  for (const auto& shard : shards) {
+    total += shard.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+auto Counter::shard_index() -> size_t {
+  static std::atomic<size_t> next_thread = 0;
+  thread_local const size_t index =
+      next_thread.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+  return index;
+}
+
+auto Histogram::bucket_index(uint64_t value) -> size_t {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  const int exponent = std::bit_width(value) - 1;
+  const auto sub_bucket =
+      (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+auto Histogram::bucket_lower_bound(size_t index) -> uint64_t {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  const int exponent =
+      static_cast<int>(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+  const auto sub_bucket = index % SUB_BUCKETS;
+  return (uint64_t{1} << exponent) |
+         (sub_bucket << (exponent - SUB_BUCKET_BITS));
+}
+
+auto Histogram::snapshot() const -> HistogramSnapshot {
+  std::array<uint64_t, BUCKETS> counts;
+  uint64_t total = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  HistogramSnapshot s;
+  s.count = total;
+  s.sum = sum.load(std::memory_order_relaxed);
+  s.max = max.load(std::memory_order_relaxed);
+  if (total == 0) {
+    return s;
+  }
+
+  // the middle of the bucket that holds the q-quantile, capped at the max
+  auto quantile = [&](double q) -> uint64_t {
+    const auto rank = static_cast<uint64_t>(q * static_cast<double>(total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen > rank) {
+        const auto lower = bucket_lower_bound(i);
+        const auto upper =
+            i + 1 < BUCKETS ? bucket_lower_bound(i + 1) : UINT64_MAX;
+        return std::min(lower + (upper - lower) / 2, s.max);
+      }
+    }
+    return s.max;
+  };
+  s.p50 = quantile(0.5);
+  s.p90 = quantile(0.9);
+  s.p99 = quantile(0.99);
+  s.p999 = quantile(0.999);
+  return s;
+}
+
+auto counter(const std::string& name) -> Counter& {
+  auto& r = registry();
+  std::lock_guard<std::mutex> l(r.mutex);
+  auto& c = r.counters[name];
+  if (c == nullptr) {
+    c = std::make_unique<Counter>();
+  }
+  return *c;
+}
+
+auto histogram(const std::string& name) -> Histogram& {
+  auto& r = registry();
+  std::lock_guard<std::mutex> l(r.mutex);
+  auto& h = r.histograms[name];
+  if (h == nullptr) {
+    h = std::make_unique<Histogram>();
+  }
+  return *h;
+}
+
+auto metrics_snapshot() -> MetricsSnapshot {
+  auto& r = registry();
+  std::lock_guard<std::mutex> l(r.mutex);
+  MetricsSnapshot snapshot;
+  for (const auto& [name, c] : r.counters) {
+    snapshot.counters[name] = c->value();
+  }
+  for (const auto& [name, h] : r.histograms) {
+    snapshot.histograms[name] = h->snapshot();
+  }
+  return snapshot;
+}
+
+auto to_prometheus_text(const MetricsSnapshot& snapshot) -> std::string {
+  std::string out;
+  for (const auto& [name, value] : snapshot.counters) {
+    absl::StrAppend(&out, "# TYPE ", name, " counter\n", name, " ", value,
+                    "\n");
+  }
+  for (const auto& [name, h] : snapshot.histograms) {
+    absl::StrAppend(&out, "# TYPE ", name, " summary\n");
+    absl::StrAppend(&out, name, "{quantile=\"0.5\"} ", h.p50, "\n");
+    absl::StrAppend(&out, name, "{quantile=\"0.9\"} ", h.p90, "\n");
+    absl::StrAppend(&out, name, "{quantile=\"0.99\"} ", h.p99, "\n");
+    absl::StrAppend(&out, name, "{quantile=\"0.999\"} ", h.p999, "\n");
+    absl::StrAppend(&out, name, "_sum ", h.sum, "\n");
+    absl::StrAppend(&out, name, "_count ", h.count, "\n");
+  }
+  return out;
+}
+
+auto to_json(const MetricsSnapshot& snapshot) -> std::string {
+  nlohmann::json j;
+  j["counters"] = nlohmann::json::object();
+  for (const auto& [name, value] : snapshot.counters) {
+    j["counters"][name] = value;
+  }
+  j["histograms"] = nlohmann::json::object();
+  for (const auto& [name, h] : snapshot.histograms) {
+    j["histograms"][name] = {{"count", h.count}, {"sum", h.sum},
+                             {"max", h.max},     {"p50", h.p50},
+                             {"p90", h.p90},     {"p99", h.p99},
+                             {"p999", h.p999}};
+  }
+  return j.dump();
+}
+
+auto write_metrics(const std::string& path, MetricsFormat format)
+    -> absl::Status {
+  const auto snapshot = metrics_snapshot();
+  const auto tmp_path = absl::StrCat(path, ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << (format == MetricsFormat::prometheus ? to_prometheus_text(snapshot)
+                                                : to_json(snapshot));
+    out.close();
+    if (!out) {
+      return absl::InternalError(absl::StrCat("failed to write ", tmp_path));
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return absl::InternalError(
+        absl::StrCat("failed to rename ", tmp_path, " to ", path));
+  }
+  return absl::OkStatus();
+}
+}  // namespace asphr
@@ -0,0 +1,177 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "absl/status/status.h"
+
+/*
+ASPHR_METRICS are process-wide counters and histograms, for seeing where the
+time of a round goes.
+
+  ASPHR_COUNTER_ADD(name, n)       adds n to the counter name
+  ASPHR_HISTOGRAM_RECORD(name, v)  records the value v in the histogram name
+  ASPHR_SCOPED_TIMER(name)         records the nanoseconds until the end of the
+                                   enclosing scope in the histogram name
+
+name must be a string literal, and is by convention snake_case with the unit
+as the last word, e.g. fast_pir_client_query_ns. Every call site looks its
+metric up once, so after the first call recording is a few relaxed atomic
+adds, with no locks and no allocation.
+
+asphr::metrics_snapshot reads all metrics, and to_prometheus_text and to_json
+turn a snapshot into text, see also write_metrics.
+
+Metrics are compiled in by default. Defining ASPHR_METRICS_OFF (bazel
+--define metrics=off) turns the macros into no-ops, like the log levels.
+*/
+
+namespace asphr {
+
+// a counter that many threads add to. the count is spread over cache lines,
+// so that threads do not contend for one.
+class Counter {
+ public:
+  auto add(uint64_t n) -> void {
+    shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  auto value() const -> uint64_t;
+
+ private:
+  static constexpr size_t SHARDS = 16;
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value = 0;
+  };
+  std::array<Shard, SHARDS> shards;
+
+  static auto shard_index() -> size_t;
+};
+
+struct HistogramSnapshot {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+  // of the bucket the quantile falls into, so within 1/16 of the true value
+  uint64_t p50 = 0;
+  uint64_t p90 = 0;
+  uint64_t p99 = 0;
+  uint64_t p999 = 0;
+};
+
+// a histogram of uint64 values, with log-linear buckets in the style of
+// HdrHistogram: every power of 2 is split into SUB_BUCKETS buckets, so the
+// buckets are within 1/SUB_BUCKETS of any value they hold. recording is lock
+// free.
+class Histogram {
+ public:
+  auto record(uint64_t value) -> void {
+    buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    auto m = max.load(std::memory_order_relaxed);
+    while (value > m &&
+           !max.compare_exchange_weak(m, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  // the counts may be off by the records that happen while this runs
+  auto snapshot() const -> HistogramSnapshot;
+
+  // exposed for the test
+  static auto bucket_index(uint64_t value) -> size_t;
+  static auto bucket_lower_bound(size_t index) -> uint64_t;
+
+ private:
+  static constexpr int SUB_BUCKET_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+  // values below SUB_BUCKETS get a bucket each, and every larger power of 2
+  // gets SUB_BUCKETS buckets
+  static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> sum = 0;
+  std::atomic<uint64_t> max = 0;
+};
+
+// records the nanoseconds between its construction and destruction
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Histogram& histogram)
+      : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    histogram.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count()));
+  }
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  auto operator=(const ScopedTimer&) -> ScopedTimer& = delete;
+
+ private:
+  Histogram& histogram;
+  const std::chrono::steady_clock::time_point start;
+};
+
+// the metric with the given name, created on first use. metrics are never
+// destroyed, so the references stay valid.
+auto counter(const std::string& name) -> Counter&;
+auto histogram(const std::string& name) -> Histogram&;
+
+struct MetricsSnapshot {
+  std::map<std::string, uint64_t> counters;
+  std::map<std::string, HistogramSnapshot> histograms;
+};
+
+auto metrics_snapshot() -> MetricsSnapshot;
+
+// counters as prometheus counters, histograms as summaries with quantiles
+// 0.5, 0.9, 0.99 and 0.999
+auto to_prometheus_text(const MetricsSnapshot& snapshot) -> std::string;
+
+auto to_json(const MetricsSnapshot& snapshot) -> std::string;
+
+enum class MetricsFormat { prometheus, json };
+
+// writes a snapshot of all metrics to path, replacing the file atomically, so
+// that a scraper never sees half a file
+auto write_metrics(const std::string& path, MetricsFormat format)
+    -> absl::Status;
+}  // namespace asphr
+
+#define ASPHR_METRICS_CONCAT_INNER(a, b) a##b
+#define ASPHR_METRICS_CONCAT(a, b) ASPHR_METRICS_CONCAT_INNER(a, b)
+
+#ifndef ASPHR_METRICS_OFF
+#define ASPHR_COUNTER_ADD(name, n)                                          \
+  {                                                                         \
+    static auto& asphr_metrics_counter = asphr::counter(name);              \
+    asphr_metrics_counter.add(n);                                           \
+  }
+#define ASPHR_HISTOGRAM_RECORD(name, v)                                     \
+  {                                                                         \
+    static auto& asphr_metrics_histogram = asphr::histogram(name);          \
+    asphr_metrics_histogram.record(v);                                      \
+  }
+#define ASPHR_SCOPED_TIMER(name)                                            \
+  static auto& ASPHR_METRICS_CONCAT(asphr_metrics_timer_histogram_,         \
+                                    __LINE__) = asphr::histogram(name);     \
+  asphr::ScopedTimer ASPHR_METRICS_CONCAT(asphr_metrics_timer_, __LINE__)(  \
+      ASPHR_METRICS_CONCAT(asphr_metrics_timer_histogram_, __LINE__))
+#else
+#define ASPHR_COUNTER_ADD(name, n) static_cast<void>(0)
+#define ASPHR_HISTOGRAM_RECORD(name, v) static_cast<void>(0)
+#define ASPHR_SCOPED_TIMER(name) static_cast<void>(0)
+#endif
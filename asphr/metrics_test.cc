@@ -0,0 +1,72 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "metrics.hpp"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+TEST(Metrics, CounterAddsFromManyThreads) {
+  auto& c = asphr::counter("metrics_test_counter");
+  {
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < 8; t++) {
+      threads.emplace_back([&c] {
+        for (int i = 0; i < 10'000; i++) {
+          c.add(1);
+        }
+      });
+    }
+  }
+  EXPECT_EQ(c.value(), 80'000);
+  // the same name is the same counter
+  EXPECT_EQ(&asphr::counter("metrics_test_counter"), &c);
+}
+
+TEST(Metrics, HistogramBuckets) {
+  for (uint64_t v :
+       {uint64_t{0}, uint64_t{1}, uint64_t{15}, uint64_t{16}, uint64_t{17},
+        uint64_t{1'000}, uint64_t{123'456'789}, UINT64_MAX}) {
+    const auto i = asphr::Histogram::bucket_index(v);
+    EXPECT_LE(asphr::Histogram::bucket_lower_bound(i), v);
+    if (v != UINT64_MAX) {
+      EXPECT_GT(asphr::Histogram::bucket_lower_bound(i + 1), v);
+    }
+  }
+}
+
+TEST(Metrics, HistogramQuantiles) {
+  asphr::Histogram h;
+  for (uint64_t v = 1; v <= 1'000; v++) {
+    h.record(v);
+  }
+  const auto s = h.snapshot();
+  EXPECT_EQ(s.count, 1'000);
+  EXPECT_EQ(s.sum, 500'500);
+  EXPECT_EQ(s.max, 1'000);
+  // the buckets are 1/16 wide
+  EXPECT_NEAR(s.p50, 500, 500 / 16);
+  EXPECT_NEAR(s.p90, 900, 900 / 16);
+  EXPECT_NEAR(s.p99, 990, 990 / 16);
+  EXPECT_LE(s.p999, 1'000);
+}
+
+TEST(Metrics, Export) {
+  asphr::counter("metrics_test_export_bytes").add(3);
+  {
+    ASPHR_SCOPED_TIMER("metrics_test_export_ns");
+  }
+  const auto snapshot = asphr::metrics_snapshot();
+  EXPECT_EQ(snapshot.counters.at("metrics_test_export_bytes"), 3);
+  EXPECT_EQ(snapshot.histograms.at("metrics_test_export_ns").count, 1);
+
+  const auto text = asphr::to_prometheus_text(snapshot);
+  EXPECT_NE(text.find("metrics_test_export_bytes 3\n"), std::string::npos);
+  EXPECT_NE(text.find("metrics_test_export_ns_count 1\n"), std::string::npos);
+  const auto json = asphr::to_json(snapshot);
+  EXPECT_NE(json.find("\"metrics_test_export_bytes\":3"), std::string::npos);
+}
@@ -0,0 +1,216 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "profiling.hpp"
+
+#ifdef ASPHR_PROFILING
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gperftools/heap-profiler.h"
+#include "gperftools/profiler.h"
+#include "log.hpp"
+
+namespace asphr {
+namespace {
+struct ProfilingState {
+  std::mutex mutex;
+  std::optional<std::string> directory;
+  bool cpu_running = false;
+  bool heap_running = false;
+  bool signal_handler_installed = false;
+  // written by the signal handler, read by the thread that toggles the
+  // profiles
+  int signal_pipe[2] = {-1, -1};
+};
+
+auto state() -> ProfilingState& {
+  static auto* s = new ProfilingState();
+  return *s;
+}
+
+// <directory>/<program>.<pid>.<time>. state().mutex must be held.
+auto profile_prefix() -> std::string {
+  auto& s = state();
+  if (!s.directory.has_value()) {
+    const char* tmpdir = std::getenv("TMPDIR");
+    s.directory = tmpdir != nullptr && tmpdir[0] != '\0' ? tmpdir : "/tmp";
+  }
+  return absl::StrCat(
+      *s.directory, "/", program_invocation_short_name, ".", getpid(), ".",
+      absl::FormatTime("%Y%m%d-%H%M%S", absl::Now(), absl::LocalTimeZone()));
+}
+
+auto start_cpu_profile_locked() -> absl::StatusOr<std::string> {
+  auto& s = state();
+  if (s.cpu_running) {
+    return absl::FailedPreconditionError("a CPU profile is already running");
+  }
+  const auto path = absl::StrCat(profile_prefix(), ".cpu.prof");
+  if (ProfilerStart(path.c_str()) == 0) {
+    return absl::InternalError(
+        absl::StrCat("failed to start the CPU profiler on ", path));
+  }
+  s.cpu_running = true;
+  return path;
+}
+
+auto stop_cpu_profile_locked() -> absl::Status {
+  auto& s = state();
+  if (!s.cpu_running) {
+    return absl::FailedPreconditionError("no CPU profile is running");
+  }
+  ProfilerStop();
+  s.cpu_running = false;
+  return absl::OkStatus();
+}
+
+auto start_heap_profile_locked() -> absl::StatusOr<std::string> {
+  if (IsHeapProfilerRunning() != 0) {
+    return absl::FailedPreconditionError("a heap profile is already running");
+  }
+  const auto prefix = profile_prefix();
+  HeapProfilerStart(prefix.c_str());
+  state().heap_running = true;
+  return prefix;
+}
+
+auto stop_heap_profile_locked() -> absl::Status {
+  if (IsHeapProfilerRunning() == 0) {
+    return absl::FailedPreconditionError("no heap profile is running");
+  }
+  HeapProfilerDump("stop_heap_profile");
+  HeapProfilerStop();
+  state().heap_running = false;
+  return absl::OkStatus();
+}
+
+auto on_signal(int) -> void {
+  const char c = 0;
+  // nothing we can do if this fails
+  [[maybe_unused]] const auto n = write(state().signal_pipe[1], &c, 1);
+}
+
+// starts both profiles if neither is running, and otherwise stops the ones
+// that are, so that one that failed to start does not keep the other from
+// stopping
+auto toggle_profiles() -> void {
+  auto& s = state();
+  std::lock_guard<std::mutex> l(s.mutex);
+  if (!s.cpu_running && !s.heap_running) {
+    const auto cpu = start_cpu_profile_locked();
+    const auto heap = start_heap_profile_locked();
+    ASPHR_LOG_INFO("Started profiling.", cpu,
+                   cpu.ok() ? *cpu : cpu.status().ToString(), heap,
+                   heap.ok() ? *heap : heap.status().ToString());
+    return;
+  }
+  if (s.cpu_running) {
+    ASPHR_LOG_INFO("Stopped profiling.", cpu,
+                   stop_cpu_profile_locked().ToString());
+  }
+  if (s.heap_running) {
+    ASPHR_LOG_INFO("Stopped profiling.", heap,
+                   stop_heap_profile_locked().ToString());
+  }
+}
+}  // namespace
+
+auto set_profile_directory(std::string directory) -> void {
+  std::lock_guard<std::mutex> l(state().mutex);
+  state().directory = std::move(directory);
+}
+
+auto start_cpu_profile() -> absl::StatusOr<std::string> {
+  std::lock_guard<std::mutex> l(state().mutex);
+  return start_cpu_profile_locked();
+}
+
+auto stop_cpu_profile() -> absl::Status {
+  std::lock_guard<std::mutex> l(state().mutex);
+  return stop_cpu_profile_locked();
+}
+
+auto start_heap_profile() -> absl::StatusOr<std::string> {
+  std::lock_guard<std::mutex> l(state().mutex);
+  return start_heap_profile_locked();
+}
+
+auto stop_heap_profile() -> absl::Status {
+  std::lock_guard<std::mutex> l(state().mutex);
+  return stop_heap_profile_locked();
+}
+
+auto install_profiling_signal_handler(int signal) -> absl::Status {
+  auto& s = state();
+  std::lock_guard<std::mutex> l(s.mutex);
+  if (s.signal_handler_installed) {
+    return absl::FailedPreconditionError(
+        "the profiling signal handler is already installed");
+  }
+  if (pipe(s.signal_pipe) != 0) {
+    return absl::InternalError(
+        absl::StrCat("failed to create a pipe: ", strerror(errno)));
+  }
+  struct sigaction action = {};
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(signal, &action, nullptr) != 0) {
+    return absl::InternalError(absl::StrCat(
+        "failed to install the signal handler: ", strerror(errno)));
+  }
+  // lives as long as the process
+  std::thread([read_fd = s.signal_pipe[0]] {
+    char c;
+    while (read(read_fd, &c, 1) == 1) {
+      toggle_profiles();
+    }
+  }).detach();
+  s.signal_handler_installed = true;
+  return absl::OkStatus();
+}
+}  // namespace asphr
+
+#else
+
+namespace asphr {
+namespace {
+auto not_built_with_profiling() -> absl::Status {
+  return absl::UnimplementedError(
+      "profiling needs a build with --define profiling=on");
+}
+}  // namespace
+
+auto set_profile_directory(std::string) -> void {}
+
+auto start_cpu_profile() -> absl::StatusOr<std::string> {
+  return not_built_with_profiling();
+}
+
+auto stop_cpu_profile() -> absl::Status { return not_built_with_profiling(); }
+
+auto start_heap_profile() -> absl::StatusOr<std::string> {
+  return not_built_with_profiling();
+}
+
+auto stop_heap_profile() -> absl::Status { return not_built_with_profiling(); }
+
+auto install_profiling_signal_handler(int) -> absl::Status {
+  return not_built_with_profiling();
+}
+}  // namespace asphr
+
+#endif
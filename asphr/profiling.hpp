@@ -0,0 +1,50 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <csignal>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+/*
+CPU and heap profiling with gperftools, for looking at a live server or daemon
+without rebuilding it.
+
+The profiler and tcmalloc are only linked in when building with
+--define profiling=on. Without it, everything here fails with
+UnimplementedError, so that binaries can call it unconditionally.
+
+Profiles are written to the profile directory ($TMPDIR, or /tmp, by default),
+and named after the program, the process id and the time the profile was
+started, e.g. /tmp/server.1234.20220601-120000.cpu.prof. Look at them with
+  pprof --web <binary> <profile>
+*/
+
+namespace asphr {
+
+auto set_profile_directory(std::string directory) -> void;
+
+// returns the path of the profile. fails if a CPU profile is already running.
+auto start_cpu_profile() -> absl::StatusOr<std::string>;
+auto stop_cpu_profile() -> absl::Status;
+
+// returns the prefix of the profiles. the heap profiler writes a numbered
+// profile to prefix.NNNN.heap every time the heap has grown by 1 GB (see
+// HEAP_PROFILE_ALLOCATION_INTERVAL), and stop_heap_profile writes a final one.
+// fails if a heap profile is already running.
+auto start_heap_profile() -> absl::StatusOr<std::string>;
+auto stop_heap_profile() -> absl::Status;
+
+// from now on, the first time the process receives signal, it starts a CPU
+// and a heap profile, the next time it stops them, and so on. the profiles are
+// started and stopped on a background thread, since the profilers are not
+// async-signal-safe. e.g.
+//   kill -USR2 <pid>; sleep 30; kill -USR2 <pid>
+auto install_profiling_signal_handler(int signal = SIGUSR2) -> absl::Status;
+
+}  // namespace asphr
@@ -0,0 +1,185 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace asphr {
+
+namespace {
+constexpr uint64_t pack_range(uint64_t begin, uint64_t end) {
+  return (begin << 32) | end;
+}
+constexpr uint64_t range_begin(uint64_t range) { return range >> 32; }
+constexpr uint64_t range_end(uint64_t range) { return range & 0xFFFF'FFFFULL; }
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : num_threads(std::max<size_t>(num_threads, 1)),
+      ranges(std::make_unique<WorkRange[]>(this->num_threads)) {
+  // thread 0 is the thread calling parallel_for
+  for (size_t i = 1; i < this->num_threads; i++) {
+    threads.emplace_back([this, i] { worker_loop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> l(mutex);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+auto ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& f)
+    -> void {
+  parallel_for_worker(n, [&f](size_t, size_t i) { f(i); });
+}
+
+auto ThreadPool::parallel_for_worker(
+    size_t n, const std::function<void(size_t, size_t)>& f) -> void {
+  if (n == 0) {
+    return;
+  }
+  assert(n < (1ULL << 32) && "parallel_for supports at most 2^32 indices");
+
+  std::lock_guard<std::mutex> call_lock(call_mutex);
+
+  if (num_threads == 1) {
+    for (size_t i = 0; i < n; i++) {
+      f(0, i);
+    }
+    return;
+  }
+
+  for (size_t w = 0; w < num_threads; w++) {
+    ranges[w].range.store(
+        pack_range(n * w / num_threads, n * (w + 1) / num_threads),
+        std::memory_order_relaxed);
+  }
+  failed.store(false, std::memory_order_relaxed);
+  error = nullptr;
+
+  {
+    std::lock_guard<std::mutex> l(mutex);
+    job = &f;
+    running = num_threads - 1;
+    generation++;
+  }
+  start_cv.notify_all();
+
+  run(0, f);
+
+  {
+    std::unique_lock<std::mutex> l(mutex);
+    done_cv.wait(l, [this] { return running == 0; });
+    job = nullptr;
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+auto ThreadPool::worker_loop(size_t worker) -> void {
+  uint64_t seen_generation = 0;
+  while (true) {
+    const std::function<void(size_t, size_t)>* f;
+    {
+      std::unique_lock<std::mutex> l(mutex);
+      start_cv.wait(l, [this, seen_generation] {
+        return stopping || generation != seen_generation;
+      });
+      if (stopping) {
+        return;
+      }
+      seen_generation = generation;
+      f = job;
+    }
+
+    run(worker, *f);
+
+    {
+      std::lock_guard<std::mutex> l(mutex);
+      running--;
+      if (running == 0) {
+        done_cv.notify_one();
+      }
+    }
+  }
+}
+
+auto ThreadPool::run(size_t worker,
+                     const std::function<void(size_t, size_t)>& f) -> void {
+  size_t index;
+  do {
+    while (pop_own(worker, index)) {
+      if (failed.load(std::memory_order_relaxed)) {
+        return;
+      }
+      try {
+        f(worker, index);
+      } catch (...) {
+        std::lock_guard<std::mutex> l(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed.store(true, std::memory_order_relaxed);
+        return;
+      }
+    }
+  } while (steal(worker));
+}
+
+auto ThreadPool::pop_own(size_t worker, size_t& index) -> bool {
+  auto& range = ranges[worker].range;
+  auto current = range.load(std::memory_order_acquire);
+  while (true) {
+    const auto begin = range_begin(current);
+    const auto end = range_end(current);
+    if (begin >= end) {
+      return false;
+    }
+    if (range.compare_exchange_weak(current, pack_range(begin + 1, end),
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_acquire)) {
+      index = begin;
+      return true;
+    }
+  }
+}
+
+auto ThreadPool::steal(size_t thief) -> bool {
+  for (size_t k = 1; k < num_threads; k++) {
+    auto& range = ranges[(thief + k) % num_threads].range;
+    auto current = range.load(std::memory_order_acquire);
+    while (true) {
+      const auto begin = range_begin(current);
+      const auto end = range_end(current);
+      if (begin >= end) {
+        break;
+      }
+      // the victim keeps [begin, mid) and we take [mid, end). if only one index
+      // is left, we take it.
+      const auto mid = begin + (end - begin) / 2;
+      if (range.compare_exchange_weak(current, pack_range(begin, mid),
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_acquire)) {
+        // our own range is empty, so nobody else writes to it right now.
+        ranges[thief].range.store(pack_range(mid, end),
+                                  std::memory_order_release);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace asphr
@@ -0,0 +1,84 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace asphr {
+
+// ThreadPool runs data-parallel loops on a fixed set of threads.
+//
+// parallel_for(n, f) calls f(i) exactly once for every i in [0, n) and returns
+// when all calls have completed. The index space is split into one contiguous
+// range per thread. A thread that runs out of work steals the upper half of the
+// remaining range of another thread, so all threads stay busy even when the
+// cost of f(i) varies between indices.
+//
+// The calling thread takes part in the loop, which means that a pool of size 1
+// spawns no threads and runs everything inline. Concurrent calls to
+// parallel_for are serialized. If f throws, the remaining indices are skipped
+// and the first exception is rethrown in the calling thread.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  auto operator=(const ThreadPool&) -> ThreadPool& = delete;
+
+  auto size() const -> size_t { return num_threads; }
+
+  auto parallel_for(size_t n, const std::function<void(size_t)>& f) -> void;
+
+  // like parallel_for, but calls f(worker, i), where worker in [0, size()) is
+  // the id of the thread running the call. no two calls with the same worker
+  // run at the same time, so f can use it to index per-thread state.
+  auto parallel_for_worker(size_t n,
+                           const std::function<void(size_t, size_t)>& f)
+      -> void;
+
+ private:
+  // a range [begin, end) packed into one word as (begin << 32) | end, so that
+  // the owner and the thieves can both update it with a single CAS.
+  struct alignas(64) WorkRange {
+    std::atomic<uint64_t> range;
+  };
+
+  auto worker_loop(size_t worker) -> void;
+  auto run(size_t worker, const std::function<void(size_t, size_t)>& f)
+      -> void;
+  auto pop_own(size_t worker, size_t& index) -> bool;
+  auto steal(size_t thief) -> bool;
+
+  const size_t num_threads;
+  std::unique_ptr<WorkRange[]> ranges;
+  std::vector<std::thread> threads;
+
+  // serializes calls to parallel_for
+  std::mutex call_mutex;
+
+  // protects everything below
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  uint64_t generation = 0;
+  size_t running = 0;
+  bool stopping = false;
+  const std::function<void(size_t, size_t)>* job = nullptr;
+  std::atomic<bool> failed = false;
+  std::exception_ptr error;
+};
+
+}  // namespace asphr
@@ -0,0 +1,74 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "thread_pool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+using asphr::ThreadPool;
+
+TEST(ThreadPool, VisitsEveryIndexOnce) {
+  for (size_t threads : {1, 2, 3, 8}) {
+    ThreadPool pool(threads);
+    for (size_t n : {0, 1, 7, 1000}) {
+      std::vector<std::atomic<int>> visits(n);
+      pool.parallel_for(n, [&](size_t i) { visits[i]++; });
+      for (size_t i = 0; i < n; i++) {
+        EXPECT_EQ(visits[i].load(), 1);
+      }
+    }
+  }
+}
+
+TEST(ThreadPool, UnevenWork) {
+  // all the work is at the front, so the other threads have to steal it.
+  ThreadPool pool(4);
+  std::atomic<uint64_t> sum = 0;
+  pool.parallel_for(64, [&](size_t i) {
+    uint64_t local = 0;
+    const uint64_t iterations = i < 8 ? 1'000'000 : 1;
+    for (uint64_t j = 0; j < iterations; j++) {
+      local += j % 3;
+    }
+    sum += local;
+  });
+  EXPECT_EQ(sum.load(), 8 * 999'999);
+}
+
+TEST(ThreadPool, RethrowsException) {
+  ThreadPool pool(4);
+  EXPECT_THROW(pool.parallel_for(100,
+                                 [](size_t i) {
+                                   if (i == 42) {
+                                     throw std::runtime_error("boom");
+                                   }
+                                 }),
+               std::runtime_error);
+
+  // the pool is still usable afterwards
+  std::atomic<size_t> count = 0;
+  pool.parallel_for(100, [&](size_t) { count++; });
+  EXPECT_EQ(count.load(), 100);
+}
+
+TEST(ThreadPool, PerWorkerState) {
+  ThreadPool pool(4);
+  // one plain counter per worker. no two calls with the same worker run at the
+  // same time, so these need no synchronization.
+  std::vector<size_t> counts(pool.size(), 0);
+  pool.parallel_for_worker(10'000, [&](size_t worker, size_t) {
+    ASSERT_LT(worker, pool.size());
+    counts[worker]++;
+  });
+  size_t total = 0;
+  for (auto count : counts) {
+    total += count;
+  }
+  EXPECT_EQ(total, 10'000);
+}
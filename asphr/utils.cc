@@ -5,73 +5,84 @@
 
 #include "utils.hpp"
 
+#include <bit>
 #include <cassert>
+#include <cstring>
 
-using std::bitset;
-using std::to_integer;
-
-using std::cout;
-using std::endl;
 using std::min;
 
-auto get_submatrix_as_uint64s(vector<byte>& db, size_t db_row_length_in_bits,
-                              size_t subm_top_left_corner_in_bits,
-                              const size_t subm_row_length_in_bits,
-                              size_t subm_rows) -> vector<uint64_t> {
-  vector<uint64_t> subm;
-  subm.reserve(subm_rows);
-  assert(subm_row_length_in_bits == 18 && "unsupported submatrix size");
-
-  // add 4 padding bytes to the db
-  for (size_t i = 0; i < 4; i++) {
-    db.push_back(byte(0));
+namespace {
+auto load_be64(const byte* p) -> uint64_t {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  if constexpr (std::endian::native == std::endian::little) {
+    v = __builtin_bswap64(v);
   }
+  return v;
+}
+}  // namespace
 
-  const auto db_rows = db.size() / (db_row_length_in_bits / 8);
-  const auto subm_start_row =
-      subm_top_left_corner_in_bits / db_row_length_in_bits;
-  const auto subm_end_row = subm_start_row + subm_rows;
-
-  const auto iterable_db_rows = min(db_rows, subm_end_row) - subm_start_row;
-  const auto paddinging_rows = subm_rows - iterable_db_rows;
-
-  for (size_t i = 0; i < iterable_db_rows; i++) {
-    const size_t db_row_index =
-        subm_top_left_corner_in_bits / 8 + i * db_row_length_in_bits / 8;
-    const int db_row_offset_in_bits = subm_top_left_corner_in_bits % 8;
-    const size_t subm_row_length_in_bytes = subm_row_length_in_bits / 8 + 1;
-
-    const auto db_row = db.begin() + db_row_index;
-
-    bitset<64> subm_row = 0;
-
-    auto first_row = bitset<8>(db_row[0]) << db_row_offset_in_bits;
-    first_row >>= db_row_offset_in_bits;
-
-    subm_row |= bitset<64>(first_row.to_ullong());
-    for (size_t j = 1; j < subm_row_length_in_bytes; j++) {
-      const auto db_byte_as_int = bitset<64>(db_row[j]);
-      subm_row <<= 8;
-      subm_row |= db_byte_as_int;
+auto get_submatrix_as_uint64s(std::span<const byte> db,
+                              size_t db_row_length_in_bits,
+                              size_t subm_top_left_corner_in_bits,
+                              size_t subm_row_length_in_bits,
+                              std::span<uint64_t> out) -> void {
+  assert(db_row_length_in_bits % 8 == 0);
+  assert(subm_row_length_in_bits >= 1 && subm_row_length_in_bits <= 64);
+  const size_t row_bytes = db_row_length_in_bits / 8;
+  const size_t bits = subm_row_length_in_bits;
+  const uint64_t mask = bits == 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+
+  const size_t db_rows = db.size() / row_bytes;
+  const size_t start_row = subm_top_left_corner_in_bits / db_row_length_in_bits;
+  // the column, relative to the start of a row
+  const size_t column = subm_top_left_corner_in_bits % db_row_length_in_bits;
+  const size_t first_byte = column / 8;
+  const size_t offset = column % 8;
+  const size_t iterable_rows =
+      min(db_rows > start_row ? db_rows - start_row : 0, out.size());
+
+  // the fast path loads the 8 bytes at first_byte with a single unaligned
+  // load. it needs the value to fit in them, to stay inside the row, and to
+  // not read past the end of db.
+  const bool fast = offset + bits <= 64 &&
+                    column + bits <= db_row_length_in_bits &&
+                    first_byte + 8 <= row_bytes;
+  size_t i = 0;
+  if (fast) {
+    const byte* p = db.data() + start_row * row_bytes + first_byte;
+    const size_t shift = 64 - offset - bits;
+    for (; i < iterable_rows; i++, p += row_bytes) {
+      out[i] = (load_be64(p) >> shift) & mask;
     }
-    // bits consumed by the first byte = 8 - db_row_offset_in_bits
-    // bits consumed by shifting = 8 * (subm_row_length_in_bytes - 1)
-    // bits_we_want_left = subm_row_length_in_bits
-    // So we shift by (bits_consumed - bits_we_want_left)
-    subm_row >>= ((8 - db_row_offset_in_bits) +
-                  8 * (subm_row_length_in_bytes - 1) - subm_row_length_in_bits);
-
-    subm.push_back(subm_row.to_ullong());
   }
-
-  for (size_t i = 0; i < paddinging_rows; i++) {
-    subm.push_back(0);
+  // the general path: gather the bytes that overlap the value, and pretend
+  // that the row is padded to the right with 0s.
+  const size_t end_byte = (column + bits + 7) / 8;
+  const size_t last_byte = min(end_byte, row_bytes);
+  const size_t trailing = 8 * end_byte - column - bits;
+  for (; i < iterable_rows; i++) {
+    const byte* row = db.data() + (start_row + i) * row_bytes;
+    unsigned __int128 acc = 0;
+    for (size_t j = first_byte; j < end_byte; j++) {
+      acc = (acc << 8) | (j < last_byte ? row[j] : 0);
+    }
+    out[i] = static_cast<uint64_t>(acc >> trailing) & mask;
   }
 
-  // remove the padding byte
-  for (size_t i = 0; i < 4; i++) {
-    db.pop_back();
+  for (; i < out.size(); i++) {
+    out[i] = 0;
   }
+}
 
+auto get_submatrix_as_uint64s(std::span<const byte> db,
+                              size_t db_row_length_in_bits,
+                              size_t subm_top_left_corner_in_bits,
+                              size_t subm_row_length_in_bits, size_t subm_rows)
+    -> vector<uint64_t> {
+  vector<uint64_t> subm(subm_rows);
+  get_submatrix_as_uint64s(db, db_row_length_in_bits,
+                           subm_top_left_corner_in_bits,
+                           subm_row_length_in_bits, subm);
   return subm;
-}
\ No newline at end of file
+}
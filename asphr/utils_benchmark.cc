@@ -0,0 +1,41 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+// concat_N_lsb_bits is benchmarked in bit_pack_benchmark.cc, next to the
+// kernels it is built on.
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace {
+constexpr size_t ROW_BITS = 1024 * 8;
+
+// one column of one seal row, as the server encodes it
+void BM_GetSubmatrixAsUint64s(benchmark::State& state) {
+  const auto rows = static_cast<size_t>(state.range(0));
+  const auto bits = static_cast<size_t>(state.range(1));
+  std::mt19937_64 rng(42);
+  std::vector<byte> db(rows * ROW_BITS / 8);
+  for (auto& b : db) {
+    b = static_cast<byte>(rng());
+  }
+  std::vector<uint64_t> out(rows);
+  // a column in the middle of the row, which is not byte aligned for 18 bits
+  const size_t column = 101 * bits;
+  for (auto _ : state) {
+    get_submatrix_as_uint64s(db, ROW_BITS, column, bits, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * rows);
+}
+}  // namespace
+
+BENCHMARK(BM_GetSubmatrixAsUint64s)
+    ->ArgNames({"rows", "bits"})
+    ->ArgsProduct({{4096, 8192}, {18, 20, 64}});
@@ -208,6 +208,43 @@ TEST(SubmatrixExtraction, ExcessRows) {
   }
 }
 
+TEST(SubmatrixExtraction, MatchesBitByBitReference) {
+  const size_t db_row_length_in_bits = 96;
+  const size_t number_of_rows = 5;
+  vector<byte> db(db_row_length_in_bits / 8 * number_of_rows);
+  for (size_t i = 0; i < db.size(); i++) {
+    db[i] = static_cast<byte>(i * 97 + 13);
+  }
+  // reads bit `column` of row `row`, with 0s past the right edge of the matrix
+  // and past the last row
+  const auto bit = [&](size_t row, size_t column) -> uint64_t {
+    if (row >= number_of_rows || column >= db_row_length_in_bits) {
+      return 0;
+    }
+    const auto b = db[row * db_row_length_in_bits / 8 + column / 8];
+    return (b >> (7 - column % 8)) & 1;
+  };
+
+  // every width and every column, including ones that go past the right edge,
+  // from the second row on, and past the last row
+  const size_t subm_rows = number_of_rows;
+  for (size_t bits = 1; bits <= 64; bits++) {
+    for (size_t column = 0; column < db_row_length_in_bits; column++) {
+      const auto subm = get_submatrix_as_uint64s(
+          db, db_row_length_in_bits, db_row_length_in_bits + column, bits,
+          subm_rows);
+      ASSERT_EQ(subm.size(), subm_rows);
+      for (size_t i = 0; i < subm_rows; i++) {
+        uint64_t expected = 0;
+        for (size_t j = 0; j < bits; j++) {
+          expected = (expected << 1) | bit(i + 1, column + j);
+        }
+        EXPECT_EQ(subm[i], expected) << bits << " bits at " << column;
+      }
+    }
+  }
+}
+
 TEST(ConcatNlsbBits, Test1) {
   vector<uint64_t> in = {0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8};
   auto out = concat_N_lsb_bits<1>(in);
@@ -8,56 +8,485 @@
 #include <assert.h>
 #include <seal/seal.h>
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <functional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "asphr/asphr.hpp"
 #include "fast_pir_config.hpp"
 
+// seal's buffer (de)serialization works on seal_byte. we (de)serialize
+// directly from and into the bytes of strings, to avoid the copies through a
+// stringstream.
+inline auto seal_input(std::string_view s) -> const seal::seal_byte* {
+  return reinterpret_cast<const seal::seal_byte*>(s.data());
+}
+inline auto seal_output(std::span<char> s) -> seal::seal_byte* {
+  return reinterpret_cast<seal::seal_byte*>(s.data());
+}
+
+// removes the next serialized seal object from the front of s and returns it,
+// using the size in its seal header, without loading it.
+// throws if the header is invalid
+inline auto next_seal_object(std::string_view& s) noexcept(false)
+    -> std::string_view {
+  seal::Serialization::SEALHeader header;
+  seal::Serialization::LoadHeader(seal_input(s), s.size(), header);
+  if (!seal::Serialization::IsValidHeader(header) || header.size == 0 ||
+      header.size > s.size()) {
+    throw std::invalid_argument("invalid seal header");
+  }
+  const auto object = s.substr(0, header.size);
+  s.remove_prefix(header.size);
+  return object;
+}
+
+// splits s into the serialized seal objects it consists of. this lets us load
+// them in parallel.
+// throws if a header is invalid
+inline auto split_seal_objects(std::string_view s) noexcept(false)
+    -> vector<std::string_view> {
+  vector<std::string_view> objects;
+  while (!s.empty()) {
+    objects.push_back(next_seal_object(s));
+  }
+  return objects;
+}
+
+// little endian, for the counts in our wire formats
+inline auto write_uint32(std::span<char> out, uint32_t value) -> void {
+  assert(out.size() >= sizeof(value));
+  for (size_t i = 0; i < sizeof(value); i++) {
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+}
+
+// throws if s is too short
+inline auto read_uint32(std::string_view s) noexcept(false) -> uint32_t {
+  if (s.size() < sizeof(uint32_t)) {
+    throw std::invalid_argument("unexpected end of input");
+  }
+  uint32_t value = 0;
+  for (size_t i = 0; i < sizeof(value); i++) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(s[i])) << (8 * i);
+  }
+  return value;
+}
+
+// loads each of objects into the corresponding ciphertext, on pool if it is not
+// null.
+// throws if deserialization fails
+inline auto load_ciphertexts(const vector<std::string_view>& objects,
+                             seal::SEALContext sc, seal::Ciphertext* out,
+                             asphr::ThreadPool* pool) noexcept(false) -> void {
+  auto load = [&](size_t i) {
+    out[i].load(sc, seal_input(objects[i]), objects[i].size());
+  };
+  if (pool == nullptr) {
+    for (size_t i = 0; i < objects.size(); i++) {
+      load(i);
+    }
+  } else {
+    pool->parallel_for(objects.size(), load);
+  }
+}
+
+// the kinds of chunks in the streaming wire format of a query
+enum class FastPIRChunkType {
+  // a piece of the serialized galois keys
+  galois_keys,
+  // one serialized query ciphertext
+  ciphertext,
+};
+
+// the largest chunk in the streaming wire format. a single ciphertext is much
+// smaller than this, but the galois keys are split into several chunks.
+constexpr size_t STREAMING_CHUNK_SIZE = 1 << 20;
+
+// The full wire format is the galois keys followed by the query ciphertexts,
+// and the key-less wire format is only the query ciphertexts. Both can be
+// written into a caller-provided buffer of save_size bytes, and read from a
+// string_view, without any intermediate copies. The query ciphertexts can be
+// loaded in parallel.
 template <typename Ciphertext_t, typename GaloisKeys_t>
 struct FastPIRQuery {
-  // TODO: STORE GALOIS KEYS IN POSTGRES, DO NOT SEND IN EVERY QUERY BECAUSE
-  // THEY DO NOT CHANGE
   vector<Ciphertext_t> query;
+  // the galois keys are only sent along in the full wire format. in the
+  // key-less wire format, the server uses galois keys that the client has
+  // registered ahead of time.
   GaloisKeys_t galois_keys;
 
+  // an upper bound on the number of bytes serialize_to_buffer writes
+  // throws if serialization fails
+  auto save_size(bool with_keys) const noexcept(false) -> size_t {
+    size_t size = with_keys ? galois_keys.save_size() : 0;
+    for (const auto& c : query) {
+      size += c.save_size();
+    }
+    return size;
+  }
+
+  // writes the full (with_keys) or key-less wire format into out, which must
+  // hold at least save_size(with_keys) bytes, and returns the number of bytes
+  // written.
+  // throws if serialization fails
+  auto serialize_to_buffer(bool with_keys, std::span<char> out) const
+      noexcept(false) -> size_t {
+    size_t position = 0;
+    if (with_keys) {
+      position += galois_keys.save(seal_output(out), out.size());
+    }
+    for (const auto& c : query) {
+      position += c.save(seal_output(out.subspan(position)),
+                         out.size() - position);
+    }
+    return position;
+  }
+
+  // throws if serialization fails
   auto serialize_to_string() noexcept(false) -> string {
-    std::stringstream s_stream;
-    galois_keys.save(s_stream);
+    return serialize_to_string_impl(true);
+  }
+
+  // throws if deserialization fails
+  auto deserialize_from_string(std::string_view s, seal::SEALContext sc,
+                               asphr::ThreadPool* pool = nullptr)
+      noexcept(false) -> void {
+    const auto position = galois_keys.load(sc, seal_input(s), s.size());
+    load_query(s.substr(position), sc, pool);
+  }
+
+  // key-less wire format: only the query ciphertexts.
+  // throws if serialization fails
+  auto serialize_to_string_without_keys() noexcept(false) -> string {
+    return serialize_to_string_impl(false);
+  }
+
+  // key-less wire format: only the query ciphertexts. galois_keys is left
+  // untouched.
+  // throws if deserialization fails
+  auto deserialize_from_string_without_keys(
+      std::string_view s, seal::SEALContext sc,
+      asphr::ThreadPool* pool = nullptr) noexcept(false) -> void {
+    load_query(s, sc, pool);
+  }
+
+  // streaming wire format: calls write once per chunk, in order. the galois
+  // keys, if with_keys, come first, split into chunks of at most
+  // STREAMING_CHUNK_SIZE bytes, followed by one chunk per query ciphertext.
+  // only one ciphertext is serialized at a time, so neither the chunk size nor
+  // the extra memory grows with the database. see FastPIRQueryStreamReader for
+  // the other side.
+  // throws if serialization fails
+  auto serialize_to_chunks(
+      bool with_keys,
+      const std::function<void(FastPIRChunkType, string)>& write)
+      noexcept(false) -> void {
+    if (with_keys) {
+      string keys(galois_keys.save_size(), '\0');
+      keys.resize(galois_keys.save(seal_output(keys), keys.size()));
+      for (size_t i = 0; i < keys.size(); i += STREAMING_CHUNK_SIZE) {
+        write(FastPIRChunkType::galois_keys,
+              keys.substr(i, STREAMING_CHUNK_SIZE));
+      }
+    }
     for (const auto& c : query) {
-      c.save(s_stream);
+      string chunk(c.save_size(), '\0');
+      chunk.resize(c.save(seal_output(chunk), chunk.size()));
+      write(FastPIRChunkType::ciphertext, std::move(chunk));
+    }
+  }
+
+ private:
+  auto serialize_to_string_impl(bool with_keys) noexcept(false) -> string {
+    ASPHR_SCOPED_TIMER("fast_pir_query_serialize_ns");
+    string s(save_size(with_keys), '\0');
+    s.resize(serialize_to_buffer(with_keys, s));
+    ASPHR_COUNTER_ADD("fast_pir_query_bytes", s.size());
+    return s;
+  }
+
+  auto load_query(std::string_view s, seal::SEALContext sc,
+                  asphr::ThreadPool* pool) noexcept(false) -> void {
+    ASPHR_SCOPED_TIMER("fast_pir_query_deserialize_ns");
+    const auto objects = split_seal_objects(s);
+    const size_t offset = query.size();
+    query.resize(offset + objects.size());
+    load_ciphertexts(objects, sc, query.data() + offset, pool);
+  }
+};
+
+// FastPIRQueryStreamReader rebuilds a query from the chunks of the streaming
+// wire format (see FastPIRQuery::serialize_to_chunks) as they arrive, so the
+// server never holds the whole serialized query.
+//
+// A stream has no message size limit, so the reader bounds the query itself:
+// at most one full set of galois keys, and at most one ciphertext per seal row
+// of a database of CLIENT_DB_ROWS rows.
+class FastPIRQueryStreamReader {
+ public:
+  using query_t = FastPIRQuery<seal::Ciphertext, seal::GaloisKeys>;
+
+  explicit FastPIRQueryStreamReader(seal::SEALContext sc)
+      : sc(sc),
+        max_galois_keys_bytes(galois_keys_size_bound(sc)),
+        max_ciphertexts(CEIL_DIV(
+            static_cast<size_t>(CLIENT_DB_ROWS),
+            sc.first_context_data()->parms().poly_modulus_degree())) {}
+
+  // throws if deserialization fails, if the chunks are out of order, or if
+  // the query is larger than the bounds above
+  auto add_chunk(FastPIRChunkType type, std::string_view chunk) noexcept(false)
+      -> void {
+    switch (type) {
+      case FastPIRChunkType::galois_keys:
+        if (!query.query.empty()) {
+          throw std::invalid_argument(
+              "galois keys must come before the query ciphertexts");
+        }
+        if (galois_keys_buffer.size() + chunk.size() > max_galois_keys_bytes) {
+          throw std::invalid_argument(asphr::StrCat(
+              "galois keys are larger than ", max_galois_keys_bytes, " bytes"));
+        }
+        galois_keys_buffer += chunk;
+        break;
+      case FastPIRChunkType::ciphertext: {
+        if (query.query.size() >= max_ciphertexts) {
+          throw std::invalid_argument(asphr::StrCat(
+              "query has more than ", max_ciphertexts, " ciphertexts"));
+        }
+        load_galois_keys();
+        seal::Ciphertext c;
+        c.load(sc, seal_input(chunk), chunk.size());
+        query.query.push_back(std::move(c));
+        break;
+      }
     }
-    return s_stream.str();
   }
 
+  // whether the stream carried galois keys. if not, the query is key-less.
+  auto has_galois_keys() const -> bool {
+    return loaded_galois_keys || !galois_keys_buffer.empty();
+  }
+
+  // returns the query, after the last chunk.
   // throws if deserialization fails
-  auto deserialize_from_string(const string& s,
-                               seal::SEALContext sc) noexcept(false) -> void {
-    auto s_stream = std::stringstream(s);
-    size_t position = 0;
-    position += galois_keys.load(sc, s_stream);
-    while (position < s.size()) {
-      seal::Ciphertext c;
-      position += c.load(sc, s_stream);
-      query.push_back(c);
+  auto finish() noexcept(false) -> query_t {
+    load_galois_keys();
+    return std::move(query);
+  }
+
+ private:
+  seal::SEALContext sc;
+  const size_t max_galois_keys_bytes;
+  const size_t max_ciphertexts;
+  query_t query;
+  // the galois keys are only loaded once all of their chunks are in
+  string galois_keys_buffer;
+  bool loaded_galois_keys = false;
+
+  // the serialized size of the galois keys for every default rotation,
+  // uncompressed. a key switching key has one ciphertext of 2 polynomials at
+  // the key level per data level prime. 1 KB per ciphertext covers the seal
+  // headers, and the worst case of compression.
+  static auto galois_keys_size_bound(const seal::SEALContext& sc) -> size_t {
+    const auto& key_data = *sc.key_context_data();
+    const size_t n = key_data.parms().poly_modulus_degree();
+    const size_t key_primes = key_data.parms().coeff_modulus().size();
+    const size_t data_primes =
+        sc.first_context_data()->parms().coeff_modulus().size();
+    const size_t keys =
+        key_data.galois_tool()->get_elts_all().size() * data_primes;
+    return keys * (2 * n * key_primes * sizeof(uint64_t) + 1024);
+  }
+
+  auto load_galois_keys() noexcept(false) -> void {
+    if (galois_keys_buffer.empty()) {
+      return;
+    }
+    query.galois_keys.load(sc, seal_input(galois_keys_buffer),
+                           galois_keys_buffer.size());
+    galois_keys_buffer = string();
+    loaded_galois_keys = true;
+  }
+};
+
+// FastPIRCompressedQuery selects a row with a constant number of ciphertexts,
+// instead of one ciphertext per seal row:
+// * slot_selector encrypts the 0/1 selection vector of the slot, and
+// * each ciphertext in row_selectors covers 2^expansion_depth seal rows, and
+//   encrypts a monomial that the server obliviously expands into one encrypted
+//   0/1 selector per seal row.
+// The server multiplies the two to get the plain query. This needs the galois
+// keys for the expansion and the relinearization keys, which are always
+// registered ahead of time, and a parameter set with enough noise budget (see
+// supports_compressed_queries).
+template <typename Ciphertext_t>
+struct FastPIRCompressedQuery {
+  uint32_t expansion_depth;
+  Ciphertext_t slot_selector;
+  vector<Ciphertext_t> row_selectors;
+
+  // throws if serialization fails
+  auto serialize_to_string() noexcept(false) -> string {
+    size_t size = sizeof(expansion_depth) + slot_selector.save_size();
+    for (const auto& c : row_selectors) {
+      size += c.save_size();
     }
+    string s(size, '\0');
+    auto out = std::span<char>(s);
+    write_uint32(out, expansion_depth);
+    size_t position = sizeof(expansion_depth);
+    position += slot_selector.save(seal_output(out.subspan(position)),
+                                   s.size() - position);
+    for (const auto& c : row_selectors) {
+      position +=
+          c.save(seal_output(out.subspan(position)), s.size() - position);
+    }
+    s.resize(position);
+    return s;
+  }
+
+  // throws if deserialization fails
+  auto deserialize_from_string(std::string_view s, seal::SEALContext sc,
+                               asphr::ThreadPool* pool = nullptr)
+      noexcept(false) -> void {
+    expansion_depth = read_uint32(s);
+    s.remove_prefix(sizeof(expansion_depth));
+    s.remove_prefix(slot_selector.load(sc, seal_input(s), s.size()));
+    const auto objects = split_seal_objects(s);
+    row_selectors.resize(objects.size());
+    load_ciphertexts(objects, sc, row_selectors.data(), pool);
   }
 };
 
 struct FastPIRAnswer {
   seal::Ciphertext answer;
 
+  // compact wire format: only the top bits of every coefficient, i.e. the
+  // ciphertext rescaled from its modulus q to 2^k, with k = log q minus
+  // ANSWER_C0_DROPPED_BITS or ANSWER_C1_DROPPED_BITS. the answer must be at
+  // the last level, which has a single prime (see
+  // FastPIRServer::finalize_answer). the format is the two values of k, one
+  // byte each, followed by the rescaled coefficients of both polynomials,
+  // packed lsb first.
+  // throws if the answer is not at the last level
+  auto serialize_to_compact_string(const seal::SEALContext& sc) const
+      noexcept(false) -> string {
+    ASPHR_SCOPED_TIMER("fast_pir_answer_serialize_compact_ns");
+    const auto context_data = sc.get_context_data(answer.parms_id());
+    if (context_data == nullptr || answer.size() != 2 ||
+        answer.is_ntt_form() ||
+        context_data->parms().coeff_modulus().size() != 1) {
+      throw std::invalid_argument(
+          "compact answers must be size 2 ciphertexts at the last level");
+    }
+    const uint64_t q = context_data->parms().coeff_modulus().front().value();
+    const auto bits = compact_bits(q);
+    const size_t n = answer.poly_modulus_degree();
+
+    string s;
+    s.reserve(2 + CEIL_DIV(n * (bits[0] + bits[1]), 8));
+    s.push_back(static_cast<char>(bits[0]));
+    s.push_back(static_cast<char>(bits[1]));
+    unsigned __int128 buffer = 0;
+    int buffered = 0;
+    for (size_t poly = 0; poly < 2; poly++) {
+      const auto mask = (uint64_t{1} << bits[poly]) - 1;
+      const auto* data = answer.data(poly);
+      for (size_t i = 0; i < n; i++) {
+        // round(c * 2^k / q) mod 2^k
+        const auto scaled = static_cast<uint64_t>(
+            ((static_cast<unsigned __int128>(data[i]) << bits[poly]) + q / 2) /
+            q);
+        buffer |= static_cast<unsigned __int128>(scaled & mask) << buffered;
+        buffered += bits[poly];
+        while (buffered >= 8) {
+          s.push_back(static_cast<char>(buffer & 0xFF));
+          buffer >>= 8;
+          buffered -= 8;
+        }
+      }
+    }
+    if (buffered > 0) {
+      s.push_back(static_cast<char>(buffer & 0xFF));
+    }
+    ASPHR_COUNTER_ADD("fast_pir_answer_compact_bytes", s.size());
+    return s;
+  }
+
+  // the answer ends up at the last level, ready to be decrypted.
+  // throws if deserialization fails
+  auto deserialize_from_compact_string(std::string_view s,
+                                       seal::SEALContext sc) noexcept(false)
+      -> void {
+    ASPHR_SCOPED_TIMER("fast_pir_answer_deserialize_compact_ns");
+    const auto context_data = sc.last_context_data();
+    const uint64_t q = context_data->parms().coeff_modulus().front().value();
+    const size_t n = context_data->parms().poly_modulus_degree();
+    const auto bits = compact_bits(q);
+    if (s.size() < 2 || static_cast<int>(s[0]) != bits[0] ||
+        static_cast<int>(s[1]) != bits[1]) {
+      throw std::invalid_argument("invalid compact answer header");
+    }
+    s.remove_prefix(2);
+    if (s.size() != CEIL_DIV(n * (bits[0] + bits[1]), 8)) {
+      throw std::invalid_argument("compact answer has the wrong size");
+    }
+
+    answer.resize(sc, context_data->parms_id(), 2);
+    answer.is_ntt_form() = false;
+    unsigned __int128 buffer = 0;
+    int buffered = 0;
+    size_t next_byte = 0;
+    for (size_t poly = 0; poly < 2; poly++) {
+      const auto mask = (uint64_t{1} << bits[poly]) - 1;
+      auto* data = answer.data(poly);
+      for (size_t i = 0; i < n; i++) {
+        while (buffered < bits[poly]) {
+          buffer |= static_cast<unsigned __int128>(
+                        static_cast<unsigned char>(s[next_byte++]))
+                    << buffered;
+          buffered += 8;
+        }
+        const auto scaled = static_cast<uint64_t>(buffer) & mask;
+        buffer >>= bits[poly];
+        buffered -= bits[poly];
+        // round(c' * q / 2^k)
+        data[i] = static_cast<uint64_t>(
+                      ((static_cast<unsigned __int128>(scaled) * q) +
+                       (uint64_t{1} << (bits[poly] - 1))) >>
+                      bits[poly]) %
+                  q;
+      }
+    }
+  }
+
   // throws if serialization fails
   auto serialize_to_string() noexcept(false) -> string {
-    std::stringstream s_stream;
-    answer.save(s_stream);
-    return s_stream.str();
+    ASPHR_SCOPED_TIMER("fast_pir_answer_serialize_ns");
+    string s(answer.save_size(), '\0');
+    s.resize(answer.save(seal_output(s), s.size()));
+    ASPHR_COUNTER_ADD("fast_pir_answer_bytes", s.size());
+    return s;
   }
   // throws if deserialization fails
-  auto deserialize_from_string(const string& s,
+  auto deserialize_from_string(std::string_view s,
                                seal::SEALContext sc) noexcept(false) -> void {
-    auto s_stream = std::stringstream(s);
-    answer.load(sc, s_stream);
+    ASPHR_SCOPED_TIMER("fast_pir_answer_deserialize_ns");
+    answer.load(sc, seal_input(s), s.size());
+  }
+
+ private:
+  // the number of bits we keep of the coefficients of each polynomial
+  static auto compact_bits(uint64_t q) -> array<int, 2> {
+    const int q_bits = std::bit_width(q);
+    return {std::max(q_bits - ANSWER_C0_DROPPED_BITS, 1),
+            std::max(q_bits - ANSWER_C1_DROPPED_BITS, 1)};
   }
 };
@@ -0,0 +1,220 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <seal/seal.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "asphr/asphr.hpp"
+#include "fast_pir.hpp"
+
+// Batch PIR retrieves several indices with one query and one answer, using
+// cuckoo hashing (as in SealPIR's batch codes):
+// * the server stores every row in each of its BATCH_PIR_HASH_FUNCTIONS
+//   candidate buckets, so the buckets together hold about 3x the database,
+// * the client assigns each of its indices to a distinct candidate bucket with
+//   cuckoo hashing, and sends one (possibly dummy) query per bucket, and
+// * the server answers every bucket, and the client decodes the buckets it
+//   used.
+// The server work is about 3 database scans no matter how many indices are in
+// the batch, instead of one scan per index, and all buckets share a single set
+// of galois keys.
+
+// number of hash functions of the cuckoo hashing
+constexpr size_t BATCH_PIR_HASH_FUNCTIONS = 3;
+// number of buckets. client and server must agree on it.
+constexpr size_t BATCH_PIR_BUCKETS = 16;
+// with 3 hash functions, cuckoo hashing succeeds with high probability as long
+// as at most 2/3 of the buckets are used.
+constexpr size_t BATCH_PIR_MAX_BATCH_SIZE = BATCH_PIR_BUCKETS * 2 / 3;
+
+// BatchPIRLayout maps every database row to its buckets, and to its position in
+// each of them. The position of a row in a bucket is the number of smaller rows
+// in the same bucket, so the layout does not depend on the size of the
+// database, and the client can compute it from an upper bound.
+class BatchPIRLayout {
+ public:
+  explicit BatchPIRLayout(size_t num_buckets)
+      : num_buckets(num_buckets), contents(num_buckets) {}
+
+  auto bucket_count() const -> size_t { return num_buckets; }
+
+  // the distinct candidate buckets of index, in hash function order
+  auto buckets(pir_index_t index) const -> vector<size_t> {
+    vector<size_t> result;
+    for (size_t i = 0; i < BATCH_PIR_HASH_FUNCTIONS; i++) {
+      const auto bucket = hash(index, i) % num_buckets;
+      if (std::find(result.begin(), result.end(), bucket) == result.end()) {
+        result.push_back(bucket);
+      }
+    }
+    return result;
+  }
+
+  // the position of index in bucket, which must be one of buckets(index)
+  auto position(pir_index_t index, size_t bucket) -> size_t {
+    extend(static_cast<size_t>(index) + 1);
+    const auto& rows = contents.at(bucket);
+    const auto it = std::lower_bound(rows.begin(), rows.end(), index);
+    assert(it != rows.end() && *it == index);
+    return it - rows.begin();
+  }
+
+  // the number of rows in bucket, for a database of db_rows rows
+  auto bucket_rows(size_t bucket, size_t db_rows) -> size_t {
+    extend(db_rows);
+    const auto& rows = contents.at(bucket);
+    return std::lower_bound(rows.begin(), rows.end(), db_rows) - rows.begin();
+  }
+
+ private:
+  const size_t num_buckets;
+  // the sorted rows of every bucket, for all rows < mapped_rows
+  vector<vector<pir_index_t>> contents;
+  size_t mapped_rows = 0;
+
+  auto extend(size_t rows) -> void {
+    for (; mapped_rows < rows; mapped_rows++) {
+      for (auto bucket : buckets(static_cast<pir_index_t>(mapped_rows))) {
+        contents.at(bucket).push_back(static_cast<pir_index_t>(mapped_rows));
+      }
+    }
+  }
+
+  // splitmix64 of (index, i). this is part of the protocol, so unlike
+  // absl::Hash it must be the same in every process, and must never change.
+  static auto hash(pir_index_t index, size_t i) -> uint64_t {
+    uint64_t x = (static_cast<uint64_t>(index) << 8 | i) +
+                 0x9E37'79B9'7F4A'7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58'476D'1CE4'E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D0'49BB'1331'11EBULL;
+    return x ^ (x >> 31);
+  }
+};
+
+// assigns every index to a distinct one of its candidate buckets. returns the
+// bucket of every index, or nullopt if cuckoo hashing fails. the indices must
+// be distinct.
+inline auto cuckoo_assign(const BatchPIRLayout& layout,
+                          const vector<pir_index_t>& indices)
+    -> optional<vector<size_t>> {
+  constexpr size_t EMPTY = std::numeric_limits<size_t>::max();
+  // the position in indices of the index in each bucket
+  vector<size_t> owner(layout.bucket_count(), EMPTY);
+  vector<size_t> assignment(indices.size(), EMPTY);
+  absl::BitGen gen;
+  const size_t max_evictions = 100 * indices.size();
+  size_t evictions = 0;
+
+  for (size_t i = 0; i < indices.size(); i++) {
+    size_t current = i;
+    while (true) {
+      const auto candidates = layout.buckets(indices[current]);
+      auto empty = std::find_if(candidates.begin(), candidates.end(),
+                                [&](size_t b) { return owner[b] == EMPTY; });
+      if (empty != candidates.end()) {
+        owner[*empty] = current;
+        assignment[current] = *empty;
+        break;
+      }
+      if (evictions++ == max_evictions) {
+        return std::nullopt;
+      }
+      // kick out the index in a random candidate bucket, and place it again
+      const auto bucket =
+          candidates[absl::Uniform<size_t>(gen, 0, candidates.size())];
+      const auto evicted = owner[bucket];
+      owner[bucket] = current;
+      assignment[current] = bucket;
+      assignment[evicted] = EMPTY;
+      current = evicted;
+    }
+  }
+  return assignment;
+}
+
+// a batch query has one key-less query per bucket, and one set of galois keys
+// for all of them. the wire format is the galois keys, followed by the number
+// of ciphertexts of each bucket (4 bytes, little endian) and its ciphertexts.
+template <typename Ciphertext_t, typename GaloisKeys_t>
+struct FastPIRBatchQuery {
+  vector<vector<Ciphertext_t>> bucket_queries;
+  GaloisKeys_t galois_keys;
+
+  // throws if serialization fails
+  auto serialize_to_string() noexcept(false) -> string {
+    size_t size = galois_keys.save_size();
+    for (const auto& bucket_query : bucket_queries) {
+      size += sizeof(uint32_t);
+      for (const auto& c : bucket_query) {
+        size += c.save_size();
+      }
+    }
+    string s(size, '\0');
+    auto out = std::span<char>(s);
+    size_t position = galois_keys.save(seal_output(out), out.size());
+    for (const auto& bucket_query : bucket_queries) {
+      write_uint32(out.subspan(position),
+                   static_cast<uint32_t>(bucket_query.size()));
+      position += sizeof(uint32_t);
+      for (const auto& c : bucket_query) {
+        position +=
+            c.save(seal_output(out.subspan(position)), out.size() - position);
+      }
+    }
+    s.resize(position);
+    return s;
+  }
+
+  // throws if deserialization fails
+  auto deserialize_from_string(std::string_view s, seal::SEALContext sc,
+                               asphr::ThreadPool* pool = nullptr)
+      noexcept(false) -> void {
+    s.remove_prefix(galois_keys.load(sc, seal_input(s), s.size()));
+    while (!s.empty()) {
+      const auto count = read_uint32(s);
+      s.remove_prefix(sizeof(uint32_t));
+      vector<std::string_view> objects;
+      for (size_t i = 0; i < count; i++) {
+        objects.push_back(next_seal_object(s));
+      }
+      bucket_queries.emplace_back(objects.size());
+      load_ciphertexts(objects, sc, bucket_queries.back().data(), pool);
+    }
+  }
+};
+
+// one answer per bucket, serialized one after the other
+struct FastPIRBatchAnswer {
+  vector<seal::Ciphertext> answers;
+
+  // throws if serialization fails
+  auto serialize_to_string() noexcept(false) -> string {
+    size_t size = 0;
+    for (const auto& c : answers) {
+      size += c.save_size();
+    }
+    string s(size, '\0');
+    auto out = std::span<char>(s);
+    size_t position = 0;
+    for (const auto& c : answers) {
+      position +=
+          c.save(seal_output(out.subspan(position)), out.size() - position);
+    }
+    s.resize(position);
+    return s;
+  }
+
+  // throws if deserialization fails
+  auto deserialize_from_string(std::string_view s,
+                               seal::SEALContext sc) noexcept(false) -> void {
+    const auto objects = split_seal_objects(s);
+    answers.resize(objects.size());
+    load_ciphertexts(objects, sc, answers.data(), nullptr);
+  }
+};
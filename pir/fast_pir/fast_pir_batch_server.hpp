@@ -0,0 +1,103 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include "asphr/asphr.hpp"
+#include "fast_pir_batch.hpp"
+#include "fast_pir_server.hpp"
+
+// BasicFastPIRBatchServer answers batch queries (see fast_pir_batch.hpp). Every
+// bucket is a BasicFastPIRServer of its own, which holds the rows of the bucket
+// in the order given by BatchPIRLayout. The buckets are answered in parallel,
+// one bucket per task, so the bucket servers themselves are single-threaded.
+//
+// Like FastPIRServer, set_value and allocate_to_max must not be called
+// concurrently with answer.
+template <typename Params>
+class BasicFastPIRBatchServer {
+ public:
+  using pir_batch_query_t =
+      FastPIRBatchQuery<seal::Ciphertext, seal::GaloisKeys>;
+  using pir_batch_answer_t = FastPIRBatchAnswer;
+
+  BasicFastPIRBatchServer(
+      seal::SEALContext sc,
+      size_t num_threads = std::thread::hardware_concurrency())
+      : sc(sc), pool(num_threads), layout(BATCH_PIR_BUCKETS) {
+    ASPHR_LOG_INFO("Creating FastPIRBatchServer.", buckets, BATCH_PIR_BUCKETS);
+    for (size_t b = 0; b < BATCH_PIR_BUCKETS; b++) {
+      buckets.push_back(make_unique<BasicFastPIRServer<Params>>(sc, 1, 1));
+      // an empty bucket still has to answer its (dummy) query
+      buckets.back()->allocate_to_max(1);
+    }
+  }
+
+  auto db_rows() const -> size_t { return rows; }
+
+  // grows the database to at least rows rows. new rows are all 0s.
+  auto allocate_to_max(size_t new_rows) -> void {
+    for (size_t b = 0; b < buckets.size(); b++) {
+      buckets[b]->allocate_to_max(layout.bucket_rows(b, new_rows));
+    }
+    rows = std::max(rows, new_rows);
+  }
+
+  // stores value in every candidate bucket of index
+  auto set_value(pir_index_t index, const pir_value_t& value) -> void {
+    for (auto b : layout.buckets(index)) {
+      buckets[b]->set_value(layout.position(index, b), value);
+    }
+    rows = std::max(rows, static_cast<size_t>(index) + 1);
+  }
+
+  auto get_value(pir_index_t index) -> pir_value_t {
+    const auto b = layout.buckets(index).front();
+    return buckets[b]->get_value(layout.position(index, b));
+  }
+
+  // throws if deserialization fails
+  auto query_from_string(std::string_view s) noexcept(false)
+      -> pir_batch_query_t {
+    pir_batch_query_t query;
+    query.deserialize_from_string(s, sc, &pool);
+    return query;
+  }
+
+  auto answer(const pir_batch_query_t& query)
+      -> asphr::StatusOr<pir_batch_answer_t> {
+    if (query.bucket_queries.size() != buckets.size()) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("batch query has ", query.bucket_queries.size(),
+                        " buckets instead of ", buckets.size()));
+    }
+    vector<asphr::StatusOr<FastPIRAnswer>> bucket_answers(
+        buckets.size());
+    pool.parallel_for(buckets.size(), [&](size_t b) {
+      bucket_answers[b] =
+          buckets[b]->answer(query.bucket_queries[b], query.galois_keys);
+    });
+
+    pir_batch_answer_t answer;
+    for (size_t b = 0; b < buckets.size(); b++) {
+      if (!bucket_answers[b].ok()) {
+        return asphr::InvalidArgumentError(
+            asphr::StrCat("failed to answer bucket ", b, ": ",
+                          bucket_answers[b].status().message()));
+      }
+      answer.answers.push_back(std::move(bucket_answers[b]->answer));
+    }
+    return answer;
+  }
+
+ private:
+  seal::SEALContext sc;
+  asphr::ThreadPool pool;
+  BatchPIRLayout layout;
+  vector<unique_ptr<BasicFastPIRServer<Params>>> buckets;
+  size_t rows = 0;
+};
+
+using FastPIRBatchServer = BasicFastPIRBatchServer<DefaultFastPIRParams>;
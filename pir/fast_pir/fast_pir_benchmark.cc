@@ -0,0 +1,207 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+// Benchmarks for one PIR round: the client query, the server answer, the wire
+// formats in between, and the client decode.
+//
+// To compare two versions, run
+//   bazel run -c opt //pir/fast_pir:fast_pir_benchmark --
+//     --benchmark_out=before.json --benchmark_out_format=json
+// (on one line) on both, and diff the files with compare.py from google
+// benchmark.
+
+#include <benchmark/benchmark.h>
+
+#include "fast_pir_client.hpp"
+#include "fast_pir_server.hpp"
+
+namespace {
+auto random_value(absl::BitGen& gen) -> pir_value_t {
+  pir_value_t value;
+  for (auto& b : value) {
+    b = absl::Uniform<byte>(gen);
+  }
+  return value;
+}
+
+// a server with db_rows random rows, encoded, and a client. building one is
+// slow, so every benchmark shares the last one it asked for.
+struct Fixture {
+  size_t db_rows;
+  FastPIRServer server;
+  FastPIRClient client;
+
+  explicit Fixture(size_t db_rows) : db_rows(db_rows), server() {
+    absl::BitGen gen;
+    server.allocate_to_max(db_rows);
+    // only a few rows are ever retrieved, the rest can stay 0
+    for (size_t i = 0; i < std::min<size_t>(db_rows, 16); i++) {
+      server.set_value(i, random_value(gen));
+    }
+    server.encode_db();
+  }
+
+  static auto get(size_t db_rows) -> Fixture& {
+    static unique_ptr<Fixture> fixture;
+    if (fixture == nullptr || fixture->db_rows != db_rows) {
+      fixture.reset();
+      fixture = make_unique<Fixture>(db_rows);
+    }
+    return *fixture;
+  }
+};
+
+const pir_index_t INDEX = 7;
+
+void BM_GenerateKeys(benchmark::State& state) {
+  for (auto _ : state) {
+    auto keys = generate_keys();
+    benchmark::DoNotOptimize(keys);
+  }
+}
+
+void BM_ClientQuery(benchmark::State& state) {
+  const auto db_rows = static_cast<size_t>(state.range(0));
+  FastPIRClient client;
+  for (auto _ : state) {
+    auto query = client.query(INDEX, db_rows);
+    benchmark::DoNotOptimize(query);
+  }
+}
+
+void BM_QuerySerialize(benchmark::State& state) {
+  const auto db_rows = static_cast<size_t>(state.range(0));
+  FastPIRClient client;
+  auto query = client.query(INDEX, db_rows).first;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    const auto s = query.serialize_to_string();
+    bytes = s.size();
+    benchmark::DoNotOptimize(s.data());
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+}
+
+void BM_QueryDeserialize(benchmark::State& state) {
+  auto& f = Fixture::get(static_cast<size_t>(state.range(0)));
+  const auto s = f.client.query(INDEX, f.db_rows).first.serialize_to_string();
+  for (auto _ : state) {
+    auto query = f.server.query_from_string(s);
+    benchmark::DoNotOptimize(query);
+  }
+  state.SetBytesProcessed(state.iterations() * s.size());
+}
+
+void BM_ServerAnswer(benchmark::State& state) {
+  auto& f = Fixture::get(static_cast<size_t>(state.range(0)));
+  const auto query = f.server.query_from_string(
+      f.client.query(INDEX, f.db_rows).first.serialize_to_string());
+  for (auto _ : state) {
+    auto answer = f.server.answer(query);
+    if (!answer.ok()) {
+      state.SkipWithError(answer.status().ToString().c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(answer->answer);
+  }
+}
+
+// the answer does not depend on db_rows, so these use the smallest database
+auto answer_for(Fixture& f) -> FastPIRServer::pir_answer_t {
+  const auto query = f.server.query_from_string(
+      f.client.query(INDEX, f.db_rows).first.serialize_to_string());
+  return *f.server.answer(query);
+}
+
+void BM_AnswerSerialize(benchmark::State& state) {
+  auto& f = Fixture::get(POLY_MODULUS_DEGREE);
+  auto answer = answer_for(f);
+  size_t bytes = 0;
+  for (auto _ : state) {
+    const auto s = state.range(0) == 0
+                       ? answer.serialize_to_string()
+                       : f.server.answer_to_compact_string(answer);
+    bytes = s.size();
+    benchmark::DoNotOptimize(s.data());
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+}
+
+void BM_AnswerDeserialize(benchmark::State& state) {
+  auto& f = Fixture::get(POLY_MODULUS_DEGREE);
+  auto answer = answer_for(f);
+  const bool compact = state.range(0) != 0;
+  const auto s = compact ? f.server.answer_to_compact_string(answer)
+                         : answer.serialize_to_string();
+  for (auto _ : state) {
+    auto parsed = compact ? f.client.answer_from_compact_string(s)
+                          : f.client.answer_from_string(s);
+    benchmark::DoNotOptimize(parsed);
+  }
+}
+
+void BM_ClientDecode(benchmark::State& state) {
+  auto& f = Fixture::get(POLY_MODULUS_DEGREE);
+  // decode takes the ticket of the query that the answer is for, and every
+  // ticket decodes once, so we make them ahead of time, outside of the timing.
+  // key-less queries all use the registered keys, so every one of their
+  // tickets decodes the answer to one of them.
+  const auto status = f.server.register_galois_keys(
+      "benchmark", f.client.galois_keys_for_registration());
+  if (!status.ok()) {
+    state.SkipWithError(status.ToString().c_str());
+    return;
+  }
+  vector<QueryTicket> tickets;
+  auto make_tickets = [&] {
+    for (size_t i = 0; i < CLIENT_QUERY_TICKETS; i++) {
+      tickets.push_back(f.client.query_without_keys(INDEX, f.db_rows)->second);
+    }
+  };
+  auto [query, ticket] = f.client.query_without_keys(INDEX, f.db_rows).value();
+  tickets.push_back(ticket);
+  const auto answer = *f.server.answer(
+      f.server.query_from_string_without_keys(
+          query.serialize_to_string_without_keys()),
+      "benchmark");
+  for (auto _ : state) {
+    if (tickets.empty()) {
+      state.PauseTiming();
+      make_tickets();
+      state.ResumeTiming();
+    }
+    auto value = f.client.decode(answer, tickets.back());
+    tickets.pop_back();
+    benchmark::DoNotOptimize(value);
+  }
+}
+}  // namespace
+
+BENCHMARK(BM_GenerateKeys)->Unit(benchmark::kMillisecond);
+// the client pays for a database of CLIENT_DB_ROWS rows on every query
+BENCHMARK(BM_ClientQuery)
+    ->ArgName("db_rows")
+    ->Arg(POLY_MODULUS_DEGREE)
+    ->Arg(16 * POLY_MODULUS_DEGREE)
+    ->Arg(CLIENT_DB_ROWS)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_QuerySerialize)
+    ->ArgName("db_rows")
+    ->Arg(POLY_MODULUS_DEGREE)
+    ->Arg(CLIENT_DB_ROWS)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_QueryDeserialize)
+    ->ArgName("db_rows")
+    ->Arg(POLY_MODULUS_DEGREE)
+    ->Arg(16 * POLY_MODULUS_DEGREE)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ServerAnswer)
+    ->ArgName("db_rows")
+    ->Arg(POLY_MODULUS_DEGREE)
+    ->Arg(16 * POLY_MODULUS_DEGREE)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_AnswerSerialize)->ArgName("compact")->Arg(0)->Arg(1);
+BENCHMARK(BM_AnswerDeserialize)->ArgName("compact")->Arg(0)->Arg(1);
+BENCHMARK(BM_ClientDecode);
@@ -6,6 +6,7 @@
 #include "fast_pir_client.hpp"
 
 auto generate_keys() -> std::pair<std::string, std::string> {
+  ASPHR_SCOPED_TIMER("fast_pir_generate_keys_ns");
   seal::SEALContext sc(create_context_params());
   seal::KeyGenerator keygen(sc);
   auto secret_key = keygen.secret_key();
@@ -5,29 +5,24 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <bitset>
 
 #include "asphr/asphr.hpp"
 #include "fast_pir.hpp"
+#include "fast_pir_batch.hpp"
+#include "fast_pir_key_pool.hpp"
+#include "fast_pir_query_tickets.hpp"
 
 using std::array;
 using std::bitset;
 
 #define DUMMY_INDEX 1'000'000
 
-struct Galois_string {
-  Galois_string(const string& s) : galois_string(s) {}
-
-  string galois_string;
-  auto save(std::ostream& os) const -> void { os << galois_string; }
-};
-
-// struct of data needs to be switched each encryption
-struct keys {
-  seal::SecretKey secret_key;
-  Galois_string galois_keys;
-};
+// number of key pairs the client generates ahead of time. each one holds a full
+// set of galois keys, which is several MB.
+constexpr size_t CLIENT_KEY_POOL_SIZE = 2;
 
 auto generate_keys() -> std::pair<std::string, std::string>;
 
@@ -35,146 +30,461 @@ auto gen_secret_key(seal::KeyGenerator keygen) -> seal::SecretKey;
 
 auto gen_galois_keys(seal::Serializable<seal::GaloisKeys> gk) -> string;
 
-class FastPIRClient {
+// BasicFastPIRClient builds PIR queries and decodes the answers, with the
+// parameter set Params (see FastPIRParams), which must be the server's.
+template <typename Params>
+class BasicFastPIRClient {
  public:
   using pir_query_t =
       FastPIRQuery<seal::Serializable<seal::Ciphertext>, Galois_string>;
+  using pir_compressed_query_t =
+      FastPIRCompressedQuery<seal::Serializable<seal::Ciphertext>>;
+  using pir_batch_query_t =
+      FastPIRBatchQuery<seal::Serializable<seal::Ciphertext>, Galois_string>;
   using pir_answer_t = FastPIRAnswer;
-  using pir_map = std::map<pir_index_t, keys>;
 
-  FastPIRClient() : FastPIRClient(create_context_params()) {
+  BasicFastPIRClient() : BasicFastPIRClient(Params::create_context_params()) {
     ASPHR_LOG_INFO("Creating FastPIRClient.", from, "base");
   }
 
-  FastPIRClient(seal::SEALContext sc)
-      : FastPIRClient(sc, seal::KeyGenerator(sc)) {
+  BasicFastPIRClient(seal::SEALContext sc)
+      : BasicFastPIRClient(sc, seal::KeyGenerator(sc)) {
     ASPHR_LOG_INFO("Creating FastPIRClient.", from, "context params");
   }
 
-  FastPIRClient(seal::SEALContext sc, seal::KeyGenerator keygen)
-      : sc(sc),
+  // the client's plaintexts, the query ciphertexts and the temporaries of
+  // encrypt_symmetric and of batch decoding come from memory_pool (or from
+  // query_memory_pools, see set_query_threads), instead of from seal's global
+  // pool, which is shared with every other thread. seal pools keep the memory
+  // of freed objects for reuse. the encryptor that every query creates, and
+  // the decryptor's temporaries, still come from the global pool: seal has no
+  // way to hand them a pool.
+  BasicFastPIRClient(seal::SEALContext sc, seal::MemoryPoolHandle memory_pool)
+      : BasicFastPIRClient(sc, seal::KeyGenerator(sc), memory_pool) {}
+
+  // throws std::invalid_argument if sc was not created from Params, see
+  // checked_context.
+  BasicFastPIRClient(
+      seal::SEALContext sc, seal::KeyGenerator keygen,
+      seal::MemoryPoolHandle memory_pool = seal::MemoryPoolHandle::New())
+      : sc(checked_context<Params>(sc)),
+        memory_pool(memory_pool),
         batch_encoder(sc),
         seal_slot_count(batch_encoder.slot_count()),
         evaluator(sc),
-        keys_map({}) {
+        plain_scratch(memory_pool),
+        select_plain(memory_pool),
+        zero_plain("0", memory_pool),
+        select_scratch(seal_slot_count, 0),
+        slot_scratch(seal_slot_count),
+        chunk_scratch(Params::SEAL_DB_COLUMNS),
+        value_scratch(
+            asphr::packed_size(Params::SEAL_DB_COLUMNS, Params::PLAIN_BITS)),
+        tickets(CLIENT_QUERY_TICKETS, CLIENT_QUERY_TICKET_TTL),
+        key_pool(make_shared<KeyPool>(sc, CLIENT_KEY_POOL_SIZE)) {
     ASPHR_LOG_INFO("Creating FastPIRClient.", from, "context params, keygen");
   }
 
-  auto query(pir_index_t index, size_t db_rows) -> pir_query_t {
-    // reinitialize the secret key to deal with the pir replay attack
-    const auto new_keys = generate_keys();
-    const auto secret_key = this->deserialize_secret_key(sc, new_keys.first);
-    const auto galois_keys = Galois_string(new_keys.second);
-    // assign new keys to the keys map
+  // returns the query, and the ticket to decode its answer with
+  auto query(pir_index_t index, size_t db_rows)
+      -> pair<pir_query_t, QueryTicket> {
+    ASPHR_SCOPED_TIMER("fast_pir_client_query_ns");
+    // reinitialize the secret key to deal with the pir replay attack. the key
+    // pool generates the keys in the background, and never hands out the same
+    // keys twice.
+    const auto new_keys = key_pool->pop();
+    // only the decryptor is kept for decode. the galois keys are several MB,
+    // and are not needed once they are sent.
     // note: you can save some time for the dummy index here.
-    keys_map.insert_or_assign(index, keys{secret_key, galois_keys});
-    // initialize encryptor
-    auto encryptor = seal::Encryptor(sc, secret_key);
-    // create the query
-    assert(index < db_rows || index == DUMMY_INDEX);
-    vector<seal::Serializable<seal::Ciphertext>> query;
-    auto seal_db_rows = CEIL_DIV(db_rows, seal_slot_count);
-    query.reserve(seal_db_rows);
-    auto seal_db_index = index / seal_slot_count;
-    for (size_t i = 0; i < seal_db_rows; i++) {
-      if (i == seal_db_index) {
-        // compute seal_db_index encryption!
-        auto coefficient_index = index % seal_slot_count;
-        vector<uint64_t> plain_coefficients(seal_slot_count, 0);
-        plain_coefficients[coefficient_index] = 1;
-        seal::Plaintext select_p;
-        batch_encoder.encode(plain_coefficients, select_p);
-        query.push_back(encryptor.encrypt_symmetric(select_p));
-      } else {
-        // TODO: we could use encyptor.encrypt_zero_symmetric here. we would
-        // probably want to audit that code first, though, because it is a less
-        // commonly used function so it has a higher risk of having bugs. and
-        // bugs here are CRITICAL.
-        seal::Plaintext p("0");
-        // note: even though these ciphertexts are all encryptions of 0, it is
-        // CRUCIAL that they are independent encryptions that is, this code MAY
-        // NOT be moved out of this loop, despite it looking like it can be. the
-        // encryption is randomized.
-        query.push_back(encryptor.encrypt_symmetric(p));
+    const auto ticket = tickets.add(index, with_decryptor(new_keys).decryptor);
+
+    auto pir_query = pir_query_t{
+        encrypt_query(index, db_rows, new_keys.secret_key),
+        new_keys.galois_keys};
+
+    return {std::move(pir_query), ticket};
+  }
+
+  // generates the key pair used by query_without_keys, and returns the
+  // serialized galois keys, which have to be registered with the server before
+  // the next key-less query.
+  //
+  // note: all key-less queries use the same secret key until the next
+  // registration, which gives up the per-query protection against the pir
+  // replay attack that query has. callers should re-register regularly.
+  auto galois_keys_for_registration() -> string {
+    const auto new_keys = key_pool->pop();
+    registered_keys =
+        with_decryptor(keys{new_keys.secret_key, Galois_string("")});
+    return new_keys.galois_keys.galois_string;
+  }
+
+  // creates a query that must be sent in the key-less wire format, i.e. with
+  // serialize_to_string_without_keys. fails if galois_keys_for_registration
+  // was not called before.
+  auto query_without_keys(pir_index_t index, size_t db_rows)
+      -> asphr::StatusOr<pair<pir_query_t, QueryTicket>> {
+    ASPHR_SCOPED_TIMER("fast_pir_client_query_ns");
+    if (!registered_keys.has_value()) {
+      return absl::FailedPreconditionError(
+          "key-less queries need registered keys");
+    }
+    const auto ticket = tickets.add(index, registered_keys->decryptor);
+    return std::make_pair(
+        pir_query_t{encrypt_query(index, db_rows, registered_keys->secret_key),
+                    Galois_string("")},
+        ticket);
+  }
+
+  // like galois_keys_for_registration, but for compressed queries. returns the
+  // serialized galois keys, which also cover the automorphisms of the query
+  // expansion, and the serialized relin keys. both have to be registered with
+  // the server. the same replay attack note applies.
+  auto compressed_keys_for_registration() -> std::pair<string, string> {
+    seal::KeyGenerator keygen(sc);
+    auto galois_elts = sc.key_context_data()->galois_tool()->get_elts_all();
+    for (size_t k = 0; (seal_slot_count >> k) > 1; k++) {
+      const auto elt = static_cast<uint32_t>((seal_slot_count >> k) + 1);
+      if (std::find(galois_elts.begin(), galois_elts.end(), elt) ==
+          galois_elts.end()) {
+        galois_elts.push_back(elt);
       }
     }
+    std::stringstream g_stream;
+    keygen.create_galois_keys(galois_elts).save(g_stream);
+    std::stringstream r_stream;
+    keygen.create_relin_keys().save(r_stream);
+    registered_keys =
+        with_decryptor(keys{keygen.secret_key(), Galois_string("")});
+    return {g_stream.str(), r_stream.str()};
+  }
 
-    // TODO: optimize this by sending over the galois keys on registration, NOT
-    // on every single query
-    auto pir_query = pir_query_t{query, galois_keys};
+  // creates a compressed query, which is a few ciphertexts instead of one per
+  // seal row. compressed_keys_for_registration must have been called before.
+  // fails if the encryption parameters are too small for compressed queries.
+  auto query_compressed(pir_index_t index, size_t db_rows)
+      -> asphr::StatusOr<pair<pir_compressed_query_t, QueryTicket>> {
+    if (!supports_compressed_queries(sc)) {
+      return absl::FailedPreconditionError(
+          "the encryption parameters are too small for compressed queries");
+    }
+    if (!registered_keys.has_value()) {
+      return absl::FailedPreconditionError(
+          "compressed queries need registered keys");
+    }
+    assert(index < db_rows || index == DUMMY_INDEX);
+    const size_t seal_db_rows = CEIL_DIV(db_rows, seal_slot_count);
+    const size_t seal_db_index = index / seal_slot_count;
 
-    return pir_query;
-  }
+    // one row selector covers 2^depth seal rows, and can cover at most N.
+    uint32_t depth = 0;
+    while ((size_t{1} << depth) < std::min(seal_db_rows, seal_slot_count)) {
+      depth++;
+    }
+    const size_t rows_per_selector = size_t{1} << depth;
 
-  auto decode(pir_answer_t answer, pir_index_t index) -> pir_value_t {
-    seal::Plaintext plain_answer;
-    // obtain the last decryptor for this query.
-    auto decryptor = seal::Decryptor(sc, keys_map.at(index).secret_key);
-    decryptor.decrypt(answer.answer, plain_answer);
+    // the expansion multiplies everything by 2^depth, so we encrypt 2^-depth
+    // mod t instead of 1. halving mod an odd t is (x + t * (x odd)) / 2.
+    const uint64_t t = sc.first_context_data()->parms().plain_modulus().value();
+    uint64_t scale = 1;
+    for (uint32_t i = 0; i < depth; i++) {
+      scale = (scale % 2 == 0 ? scale : scale + t) / 2;
+    }
 
-    vector<uint64_t> message_coefficients;
-    batch_encoder.decode(plain_answer, message_coefficients);
+    const auto ticket = tickets.add(index, registered_keys->decryptor);
+    auto encryptor = seal::Encryptor(sc, registered_keys->secret_key);
 
-    assert(message_coefficients.size() == seal_slot_count);
+    vector<uint64_t> slot_coefficients(seal_slot_count, 0);
+    slot_coefficients[index % seal_slot_count] = 1;
+    seal::Plaintext slot_p;
+    batch_encoder.encode(slot_coefficients, slot_p);
 
-    // rotate!
-    if (index % seal_slot_count > seal_slot_count / 2) {
-      vector<uint64_t> message_coefficients_new(seal_slot_count);
-      for (size_t i = 0; i < seal_slot_count; i++) {
-        message_coefficients_new[i] =
-            message_coefficients[(i + seal_slot_count / 2) % seal_slot_count];
+    vector<seal::Serializable<seal::Ciphertext>> row_selectors;
+    for (size_t i = 0; i < CEIL_DIV(seal_db_rows, rows_per_selector); i++) {
+      seal::Plaintext p("0");
+      if (seal_db_index / rows_per_selector == i) {
+        // the monomial scale * x^k, in the coefficient encoding
+        p = seal::Plaintext(seal_slot_count);
+        p[seal_db_index % rows_per_selector] = scale;
       }
-      message_coefficients = message_coefficients_new;
-    }
-    // rotate even more!
-    vector<uint64_t> message_coefficients_new(seal_slot_count);
-    for (size_t r = 0; r < 2; r++) {
-      for (size_t i = 0; i < seal_slot_count / 2; i++) {
-        message_coefficients_new[r * seal_slot_count / 2 + i] =
-            message_coefficients[(i + index) % (seal_slot_count / 2) +
-                                 r * seal_slot_count / 2];
+      // as in encrypt_query, every ciphertext must be an independent
+      // encryption.
+      row_selectors.push_back(encryptor.encrypt_symmetric(p));
+    }
+
+    return std::make_pair(
+        pir_compressed_query_t{depth, encryptor.encrypt_symmetric(slot_p),
+                               std::move(row_selectors)},
+        ticket);
+  }
+
+  // encrypts the ciphertexts of each query in parallel on num_threads threads.
+  // the default, and num_threads <= 1, encrypts them one after the other on the
+  // calling thread. every thread allocates from a memory pool of its own.
+  auto set_query_threads(size_t num_threads) -> void {
+    query_memory_pools.clear();
+    if (num_threads <= 1) {
+      query_pool = nullptr;
+    } else {
+      query_pool = make_shared<asphr::ThreadPool>(num_threads);
+      for (size_t i = 0; i < num_threads; i++) {
+        query_memory_pools.push_back(seal::MemoryPoolHandle::New());
       }
     }
-    message_coefficients = message_coefficients_new;
+  }
+
+  // creates one query for all of indices, which must be distinct, and at most
+  // BATCH_PIR_MAX_BATCH_SIZE many. see fast_pir_batch.hpp. fails in the rare
+  // case that cuckoo hashing fails, in which case the caller can retry, or
+  // split the batch. the ticket goes to batch_decode with the answer, like
+  // the ticket of query.
+  auto batch_query(const vector<pir_index_t>& indices, size_t db_rows)
+      -> asphr::StatusOr<pair<pir_batch_query_t, QueryTicket>> {
+    if (indices.size() > BATCH_PIR_MAX_BATCH_SIZE) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("batch has ", indices.size(), " indices, at most ",
+                        BATCH_PIR_MAX_BATCH_SIZE, " are allowed"));
+    }
+    if (batch_layout == nullptr) {
+      batch_layout = make_shared<BatchPIRLayout>(BATCH_PIR_BUCKETS);
+    }
+    const auto assignment = cuckoo_assign(*batch_layout, indices);
+    if (!assignment.has_value()) {
+      return absl::ResourceExhaustedError("cuckoo hashing failed");
+    }
+
+    // one key pair for the whole batch
+    const auto new_keys = key_pool->pop();
+    BatchPositions positions;
+    vector<pir_index_t> bucket_index(BATCH_PIR_BUCKETS, DUMMY_INDEX);
+    for (size_t i = 0; i < indices.size(); i++) {
+      const auto bucket = assignment->at(i);
+      const auto position = batch_layout->position(indices[i], bucket);
+      bucket_index[bucket] = static_cast<pir_index_t>(position);
+      positions.insert_or_assign(indices[i], std::make_pair(bucket, position));
+    }
 
-    auto message_bytes_vector =
-        concat_N_lsb_bits<PLAIN_BITS>(message_coefficients);
+    pir_batch_query_t batch_query{{}, new_keys.galois_keys};
+    for (size_t b = 0; b < BATCH_PIR_BUCKETS; b++) {
+      // every bucket has at least one row, see FastPIRBatchServer
+      const auto bucket_rows =
+          std::max<size_t>(batch_layout->bucket_rows(b, db_rows), 1);
+      batch_query.bucket_queries.push_back(
+          encrypt_query(bucket_index[b], bucket_rows, new_keys.secret_key));
+    }
+    const auto ticket = tickets.add_batch(std::move(positions),
+                                          with_decryptor(new_keys).decryptor);
+    return std::make_pair(std::move(batch_query), ticket);
+  }
 
-    assert(message_bytes_vector.size() >= MESSAGE_SIZE);
+  // decodes the answer to the batch query of ticket, and returns the values of
+  // indices, which must all have been in that batch. like decode, a ticket can
+  // be decoded only once.
+  auto batch_decode(const FastPIRBatchAnswer& answer, QueryTicket ticket,
+                    const vector<pir_index_t>& indices)
+      -> asphr::StatusOr<vector<pir_value_t>> {
+    if (answer.answers.size() != BATCH_PIR_BUCKETS) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("batch answer has ", answer.answers.size(),
+                        " buckets, expected ", BATCH_PIR_BUCKETS));
+    }
+    auto positions_and_decryptor = tickets.take_batch(ticket);
+    if (!positions_and_decryptor.ok()) {
+      return positions_and_decryptor.status();
+    }
+    const auto& [positions, decryptor] = positions_and_decryptor.value();
+    vector<pir_value_t> values;
+    for (auto index : indices) {
+      const auto it = positions.find(index);
+      if (it == positions.end()) {
+        return asphr::InvalidArgumentError(
+            asphr::StrCat("index ", index, " was not in the batch"));
+      }
+      const auto [bucket, position] = it->second;
+      values.push_back(decode_with_decryptor(answer.answers.at(bucket),
+                                             static_cast<pir_index_t>(position),
+                                             *decryptor));
+    }
+    return values;
+  }
 
-    array<byte, MESSAGE_SIZE> message_bytes;
-    for (size_t i = 0; i < MESSAGE_SIZE; i++) {
-      message_bytes[i] = message_bytes_vector[i];
+  // decodes the answer to the query of ticket, which can be decoded only
+  // once. fails if the ticket has expired, see QueryTicketStore.
+  //
+  // on success, does no heap allocation, apart from seal's memory pools, which
+  // reuse their allocations, and the metrics lookup of the very first call.
+  // the decryptor allocates from the global pool, the rest from memory_pool.
+  auto decode(const pir_answer_t& answer, QueryTicket ticket)
+      -> asphr::StatusOr<pir_value_t> {
+    auto index_and_decryptor = tickets.take(ticket);
+    if (!index_and_decryptor.ok()) {
+      return index_and_decryptor.status();
     }
+    const auto& [index, decryptor] = index_and_decryptor.value();
+    return decode_with_decryptor(answer.answer, index, *decryptor);
+  }
 
-    return pir_value_t{message_bytes};
+  // at most capacity queries can be in flight, and their answers have to be
+  // decoded within ttl. drops the tickets of all queries in flight.
+  auto set_query_ticket_limits(size_t capacity, absl::Duration ttl) -> void {
+    tickets = QueryTicketStore(capacity, ttl);
   }
 
   // throws if deserialization fails
-  auto answer_from_string(const string& s) const noexcept(false)
+  auto batch_answer_from_string(std::string_view s) const noexcept(false)
+      -> FastPIRBatchAnswer {
+    FastPIRBatchAnswer answer;
+    answer.deserialize_from_string(s, sc);
+    return answer;
+  }
+
+  // throws if deserialization fails
+  auto answer_from_string(std::string_view s) const noexcept(false)
       -> pir_answer_t {
     pir_answer_t answer;
     answer.deserialize_from_string(s, sc);
     return answer;
   }
 
+  // the compact wire format, see FastPIRAnswer::serialize_to_compact_string
+  // throws if deserialization fails
+  auto answer_from_compact_string(std::string_view s) const noexcept(false)
+      -> pir_answer_t {
+    pir_answer_t answer;
+    answer.deserialize_from_compact_string(s, sc);
+    return answer;
+  }
+
  private:
   seal::SEALContext sc;
+  seal::MemoryPoolHandle memory_pool;
   seal::BatchEncoder batch_encoder;
   // number of slots in the plaintext
   const size_t seal_slot_count;
   seal::Evaluator evaluator;
 
-  // because we "batch" PIR encryption together, we need to know the keypair
-  // corresponding to each index.
-  // A Map (index -> keypair)
-  pir_map keys_map;
+  // scratch space for decode
+  seal::Plaintext plain_scratch;
+  // reused by every query
+  seal::Plaintext select_plain;
+  const seal::Plaintext zero_plain;
+  // all 0s between queries
+  vector<uint64_t> select_scratch;
+  vector<uint64_t> slot_scratch;
+  vector<uint64_t> chunk_scratch;
+  vector<unsigned char> value_scratch;
+
+  // what decode and batch_decode need for each query in flight, by ticket
+  QueryTicketStore tickets;
+
+  // the keys for key-less queries, set by galois_keys_for_registration
+  optional<keys> registered_keys;
+
+  // computed lazily, since it takes some memory
+  shared_ptr<BatchPIRLayout> batch_layout;
+
+  // shared, so that copies of the client draw from the same pool
+  shared_ptr<KeyPool> key_pool;
 
-  auto deserialize_secret_key(seal::SEALContext sc, string secret_key)
-      -> seal::SecretKey {
-    auto s_stream = std::stringstream(secret_key);
-    seal::SecretKey sk;
-    sk.load(sc, s_stream);
-    return sk;
+  // if set, the query ciphertexts are encrypted in parallel on this pool, and
+  // thread i allocates from query_memory_pools[i]
+  shared_ptr<asphr::ThreadPool> query_pool;
+  vector<seal::MemoryPoolHandle> query_memory_pools;
+
+  auto with_decryptor(keys k) -> keys {
+    if (k.decryptor == nullptr) {
+      k.decryptor = make_shared<seal::Decryptor>(sc, k.secret_key);
+    }
+    return k;
+  }
+
+  // the server puts chunk j of the value in slot (index + j) mod N/2 of the
+  // matrix row that index is in, see FastPIRServer. we gather the chunks
+  // straight from there, instead of rotating the slots first, and pack them
+  // msb first like concat_N_lsb_bits.
+  auto decode_with_decryptor(const seal::Ciphertext& answer, pir_index_t index,
+                             seal::Decryptor& decryptor) -> pir_value_t {
+    ASPHR_SCOPED_TIMER("fast_pir_client_decode_ns");
+    decryptor.decrypt(answer, plain_scratch);
+    batch_encoder.decode(
+        plain_scratch,
+        gsl::span<uint64_t>(slot_scratch.data(), slot_scratch.size()),
+        memory_pool);
+
+    const size_t half = seal_slot_count / 2;
+    const size_t row_offset = index % seal_slot_count >= half ? half : 0;
+    for (size_t j = 0; j < chunk_scratch.size(); j++) {
+      chunk_scratch[j] = slot_scratch[row_offset + (index + j) % half];
+    }
+    asphr::pack_lsb_bits(chunk_scratch, Params::PLAIN_BITS, value_scratch);
+    pir_value_t value;
+    std::copy_n(value_scratch.begin(), MESSAGE_SIZE, value.begin());
+    return value;
+  }
+
+  auto encrypt_query(pir_index_t index, size_t db_rows,
+                     const seal::SecretKey& secret_key)
+      -> vector<seal::Serializable<seal::Ciphertext>> {
+    // create the query
+    assert(index < db_rows || index == DUMMY_INDEX);
+    auto seal_db_rows = CEIL_DIV(db_rows, seal_slot_count);
+    auto seal_db_index = index / seal_slot_count;
+    // seal::Serializable cannot be default constructed
+    vector<optional<seal::Serializable<seal::Ciphertext>>> ciphertexts(
+        seal_db_rows);
+    auto encrypt_row = [&](const seal::Encryptor& encryptor, size_t i,
+                           const seal::MemoryPoolHandle& pool) {
+      if (i == seal_db_index) {
+        // compute seal_db_index encryption! only one thread gets here, so it
+        // can use the shared scratch space.
+        auto coefficient_index = index % seal_slot_count;
+        select_scratch[coefficient_index] = 1;
+        batch_encoder.encode(select_scratch, select_plain);
+        select_scratch[coefficient_index] = 0;
+        ciphertexts[i].emplace(encryptor.encrypt_symmetric(select_plain, pool));
+      } else {
+        // TODO: we could use encyptor.encrypt_zero_symmetric here. we would
+        // probably want to audit that code first, though, because it is a less
+        // commonly used function so it has a higher risk of having bugs. and
+        // bugs here are CRITICAL.
+        //
+        // note: even though these ciphertexts are all encryptions of 0, it is
+        // CRUCIAL that they are independent encryptions that is, this code MAY
+        // NOT be moved out of this loop, despite it looking like it can be. the
+        // encryption is randomized. (the plaintext can be shared, it is the
+        // same for all of them.)
+        ciphertexts[i].emplace(encryptor.encrypt_symmetric(zero_plain, pool));
+      }
+    };
+
+    if (query_pool == nullptr) {
+      // initialize encryptor
+      auto encryptor = seal::Encryptor(sc, secret_key);
+      for (size_t i = 0; i < seal_db_rows; i++) {
+        encrypt_row(encryptor, i, memory_pool);
+      }
+    } else {
+      // every worker gets its own encryptor. the randomness stays independent
+      // across ciphertexts: seal seeds a fresh PRNG from the system's random
+      // device for every single encrypt_symmetric call.
+      vector<optional<seal::Encryptor>> encryptors(query_pool->size());
+      query_pool->parallel_for_worker(
+          seal_db_rows, [&](size_t worker, size_t i) {
+            if (!encryptors[worker].has_value()) {
+              encryptors[worker].emplace(sc, secret_key);
+            }
+            encrypt_row(encryptors[worker].value(), i,
+                        query_memory_pools[worker]);
+          });
+    }
+
+    vector<seal::Serializable<seal::Ciphertext>> query;
+    query.reserve(seal_db_rows);
+    for (auto& c : ciphertexts) {
+      query.push_back(std::move(c.value()));
+    }
+    return query;
   }
 };
+
+using FastPIRClient = BasicFastPIRClient<DefaultFastPIRParams>;
@@ -5,65 +5,205 @@
 
 #pragma once
 
+#include <seal/seal.h>
+
 #include <array>
 #include <bit>
 #include <cstddef>
 #include <cstdint>
+#include <stdexcept>
 #include <vector>
 
 #include "asphr/asphr.hpp"
 
-// these parameters are taken from
-// https://github.com/ishtiyaque/FastPIR/blob/master/src/bfvparams.h
-// TODO: optimize them
-
 using std::array;
 using std::size_t;
 using std::vector;
 
-constexpr size_t POLY_MODULUS_DEGREE = 4096;
-static_assert(std::popcount(POLY_MODULUS_DEGREE) == 1,
-              "POLY_MODULUS_DEGREE must be a power of 2");
+// deterministic miller-rabin, which is exact for all 64-bit n with these bases
+constexpr auto is_prime(uint64_t n) -> bool {
+  constexpr uint64_t BASES[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+  if (n < 2) {
+    return false;
+  }
+  for (const auto p : BASES) {
+    if (n % p == 0) {
+      return n == p;
+    }
+  }
+  const auto mul_mod = [n](uint64_t a, uint64_t b) -> uint64_t {
+    return static_cast<uint64_t>(static_cast<unsigned __int128>(a) * b % n);
+  };
+  uint64_t d = n - 1;
+  int s = 0;
+  while (d % 2 == 0) {
+    d /= 2;
+    s++;
+  }
+  for (const auto a : BASES) {
+    // x = a^d mod n
+    uint64_t x = 1;
+    for (uint64_t base = a, e = d; e > 0; e /= 2) {
+      if (e % 2 == 1) {
+        x = mul_mod(x, base);
+      }
+      base = mul_mod(base, base);
+    }
+    if (x == 1 || x == n - 1) {
+      continue;
+    }
+    bool witness = true;
+    for (int i = 1; i < s && witness; i++) {
+      x = mul_mod(x, x);
+      witness = x != n - 1;
+    }
+    if (witness) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the NTT over a modulus q needs a primitive 2N-th root of unity mod q, which
+// exists for a prime q iff q = 1 mod 2N. this holds for the coefficient primes
+// and, so that batching works, for the plain modulus.
+constexpr auto is_ntt_friendly(uint64_t q, size_t poly_modulus_degree) -> bool {
+  return is_prime(q) && q % (2 * poly_modulus_degree) == 1;
+}
 
-constexpr uint64_t PRIME_54 = 18'014'398'509'309'953ULL;
-// static_assert(is_prime(PRIME_54), "PRIME_54 must be prime"); // seems
-// unnecessary to code this up just to check this. VERIFY MANUALLY.
+// FastPIRParams is a parameter set. The FastPIR classes are templates over it,
+// so every set is checked at compile time, and the set that suits the database
+// size and hardware can be picked without touching the code.
+//
+// The last coefficient prime is the special prime, which is only used for key
+// switching, so the data level has all the other primes.
+template <size_t PolyModulusDegree, uint64_t PlainBits, uint64_t PlainModulus,
+          uint64_t... CoeffModulusFactorization>
+struct FastPIRParams {
+  static constexpr size_t POLY_MODULUS_DEGREE = PolyModulusDegree;
+  // number of bits we store per coefficient
+  static constexpr uint64_t PLAIN_BITS = PlainBits;
+  static constexpr uint64_t PLAIN_MODULUS = PlainModulus;
+  static constexpr array<uint64_t, sizeof...(CoeffModulusFactorization)>
+      COEFF_MODULUS_FACTORIZATION = {CoeffModulusFactorization...};
+  // number of coefficients a message is split into
+  static constexpr int SEAL_DB_COLUMNS =
+      CEIL_DIV(MESSAGE_SIZE_BITS, PLAIN_BITS);
+
+  static_assert(std::popcount(POLY_MODULUS_DEGREE) == 1,
+                "POLY_MODULUS_DEGREE must be a power of 2");
+  static_assert(PLAIN_BITS >= 1 && PLAIN_BITS < 64);
+  static_assert(PLAIN_MODULUS > 1ULL << PLAIN_BITS,
+                "PLAIN_MODULUS must be greater than 2^PLAIN_BITS");
+  static_assert(is_ntt_friendly(PLAIN_MODULUS, POLY_MODULUS_DEGREE),
+                "PLAIN_MODULUS must be a prime congruent to 1 modulo "
+                "2*POLY_MODULUS_DEGREE");
+  static_assert(COEFF_MODULUS_FACTORIZATION.size() >= 2,
+                "need at least one data prime and the special prime");
+  static_assert((is_ntt_friendly(CoeffModulusFactorization,
+                                 POLY_MODULUS_DEGREE) &&
+                 ...),
+                "every coefficient prime must be a prime congruent to 1 "
+                "modulo 2*POLY_MODULUS_DEGREE");
+  // SEAL's 128-bit security bounds on the total coefficient modulus bits
+  static_assert((std::bit_width(CoeffModulusFactorization) + ...) <=
+                    (POLY_MODULUS_DEGREE == 4096   ? 109
+                     : POLY_MODULUS_DEGREE == 8192 ? 218
+                                                   : 438),
+                "the coefficient modulus is too large for 128-bit security");
+
+  static auto create_context_params() -> seal::EncryptionParameters {
+    seal::EncryptionParameters params(seal::scheme_type::bfv);
+    params.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
+    vector<seal::Modulus> coeff_modulus;
+    for (auto prime : COEFF_MODULUS_FACTORIZATION) {
+      coeff_modulus.push_back(seal::Modulus(prime));
+    }
+    params.set_coeff_modulus(coeff_modulus);
+    params.set_plain_modulus(PLAIN_MODULUS);
+    return params;
+  }
+
+  // whether sc has the poly modulus degree and the plain modulus of this set,
+  // which the database layout and the decoding depend on
+  static auto matches(const seal::SEALContext &sc) -> bool {
+    const auto &parms = sc.key_context_data()->parms();
+    return parms.poly_modulus_degree() == POLY_MODULUS_DEGREE &&
+           parms.plain_modulus().value() == PLAIN_MODULUS;
+  }
+};
 
+// returns sc, for the member initializers of the classes templated over
+// Params. throws std::invalid_argument if sc does not match Params, since the
+// layout would silently be that of Params and the ciphertexts those of sc.
+template <typename Params>
+auto checked_context(const seal::SEALContext &sc) noexcept(false)
+    -> const seal::SEALContext & {
+  if (!Params::matches(sc)) {
+    const auto &parms = sc.key_context_data()->parms();
+    throw std::invalid_argument(asphr::StrCat(
+        "the SEAL context has poly modulus degree ",
+        parms.poly_modulus_degree(), " and plain modulus ",
+        parms.plain_modulus().value(), ", but the parameter set has ",
+        Params::POLY_MODULUS_DEGREE, " and ", Params::PLAIN_MODULUS));
+  }
+  return sc;
+}
+
+// taken from
+// https://github.com/ishtiyaque/FastPIR/blob/master/src/bfvparams.h
+constexpr uint64_t PRIME_54 = 18'014'398'509'309'953ULL;
 constexpr uint64_t PRIME_55 = 36'028'797'018'652'673ULL;
-// static_assert(is_prime(PRIME_55), "PRIME_55 must be prime"); // seems
-// unnecessary to code this up just to check this. VERIFY MANUALLY.
-
-constexpr array<uint64_t, 2> COEFF_MODULUS_FACTORIZATION({PRIME_54, PRIME_55});
-
-// number of bits we store per coefficient. we store a power of 2 because
-// performing modulo mod 2 is much much faster, when encoding
-constexpr uint64_t PLAIN_BITS = 18;
-
-// must be greater than 2^PLAIN_BITS
-// must also be congruent to 1 modulo 2*POLY_MODULUS_DEGREE
-// finally, must also be a prime
-constexpr uint64_t PLAIN_MODULUS = 270'337;
-static_assert(PLAIN_MODULUS >= 1ULL << PLAIN_BITS,
-              "PLAIN_MODULUS must be greater than 2^PLAIN_BITS");
-static_assert(
-    PLAIN_MODULUS % (2 * POLY_MODULUS_DEGREE) == 1,
-    "PLAIN_MODULUS must be congruent to 1 modulo 2*POLY_MODULUS_DEGREE");
-// static_assert(is_prime(PLAIN_MODULUS), "PLAIN_MODULUS must be prime"); //
-// seems unnecessary to code this up just to check this. VERIFY MANUALLY.
+using FastPIRParams4096 =
+    FastPIRParams<4096, 18, 270'337, PRIME_54, PRIME_55>;
+
+// twice the slots per plaintext and wider coefficients, so fewer columns, and
+// a data level of 3 primes, which also has room for compressed queries. the
+// primes are the largest 56-bit and 50-bit primes that are 1 mod 16384.
+using FastPIRParams8192 =
+    FastPIRParams<8192, 20, 1'097'729, 72'057'594'037'616'641ULL,
+                  72'057'594'037'370'881ULL, 72'057'594'037'338'113ULL,
+                  1'125'899'906'826'241ULL>;
+
+using DefaultFastPIRParams = FastPIRParams4096;
+
+// the default parameter set, for code that is not templated over it
+constexpr size_t POLY_MODULUS_DEGREE =
+    DefaultFastPIRParams::POLY_MODULUS_DEGREE;
+constexpr uint64_t PLAIN_BITS = DefaultFastPIRParams::PLAIN_BITS;
+constexpr uint64_t PLAIN_MODULUS = DefaultFastPIRParams::PLAIN_MODULUS;
+constexpr auto COEFF_MODULUS_FACTORIZATION =
+    DefaultFastPIRParams::COEFF_MODULUS_FACTORIZATION;
+constexpr int SEAL_DB_COLUMNS = DefaultFastPIRParams::SEAL_DB_COLUMNS;
 
 static auto create_context_params() -> seal::EncryptionParameters {
-  seal::EncryptionParameters params(seal::scheme_type::bfv);
-  params.set_poly_modulus_degree(POLY_MODULUS_DEGREE);
-  vector<seal::Modulus> coeff_modulus;
-  for (auto &prime : COEFF_MODULUS_FACTORIZATION) {
-    coeff_modulus.push_back(seal::Modulus(prime));
+  return DefaultFastPIRParams::create_context_params();
+}
+
+// compressed queries (see FastPIRCompressedQuery) multiply two ciphertexts on
+// the server before the usual plaintext multiplication, which takes much more
+// noise budget than a plain query. this is a conservative lower bound on the
+// size of the data level coefficient modulus they need. the default parameters
+// above are far below it.
+constexpr int COMPRESSED_QUERY_MIN_DATA_MODULUS_BITS = 120;
+
+static auto supports_compressed_queries(const seal::SEALContext &sc) -> bool {
+  int data_modulus_bits = 0;
+  for (const auto &modulus : sc.first_context_data()->parms().coeff_modulus()) {
+    data_modulus_bits += modulus.bit_count();
   }
-  params.set_coeff_modulus(coeff_modulus);
-  params.set_plain_modulus(PLAIN_MODULUS);
-  return params;
+  return data_modulus_bits >= COMPRESSED_QUERY_MIN_DATA_MODULUS_BITS;
 }
 
-constexpr int SEAL_DB_COLUMNS = CEIL_DIV(MESSAGE_SIZE_BITS, PLAIN_BITS);
+// the compact answer format (see FastPIRAnswer::serialize_to_compact_string)
+// drops this many low-order bits of the coefficients of the two answer
+// polynomials. this adds noise of about 2^ANSWER_C0_DROPPED_BITS, and about
+// sqrt(POLY_MODULUS_DEGREE) * 2^ANSWER_C1_DROPPED_BITS, since the second
+// polynomial is multiplied by the secret key. both are far below the noise of
+// a plaintext multiplication with a full database plaintext, which every
+// answer has, so this costs very little noise budget.
+constexpr int ANSWER_C0_DROPPED_BITS = 20;
+constexpr int ANSWER_C1_DROPPED_BITS = 12;
 
 // CLIENT_DB_ROWS is the number of rows that the client thinks is in the
 // database. this must be an upper bound on the actual database size. note that
@@ -74,7 +214,8 @@ constexpr int SEAL_DB_COLUMNS = CEIL_DIV(MESSAGE_SIZE_BITS, PLAIN_BITS);
 // one pair. this would destroy security!
 //
 // We set it to 360K for now, limiting # edges in the social graph to 360K. This
-// is to be under the GRPC message size limit of 4 MB — to increase this, use
-// GRPC streaming instead. See
-// https://jbrandhorst.com/post/grpc-binary-blob-stream/.
+// is to be under the GRPC message size limit of 4 MB for ReceiveMessage.
+// ReceiveMessageStreamed sends the query in chunks (see
+// FastPIRQuery::serialize_to_chunks) and has no such limit, so this can grow
+// once all clients use it.
 constexpr int CLIENT_DB_ROWS = 360'000;
\ No newline at end of file
@@ -0,0 +1,179 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <seal/seal.h>
+
+#include <algorithm>
+
+#include "asphr/asphr.hpp"
+#include "fast_pir_config.hpp"
+#include "pir_database.hpp"
+
+// BasicFastPIRDatabase stores the PIR database both as coefficients (see
+// PIRDatabase) and as encoded plaintexts that are ready to be multiplied with a
+// query.
+//
+// Row r of the database lives in seal row r / seal_slot_count, in slot
+// r % seal_slot_count, and is split into Params::SEAL_DB_COLUMNS chunks of
+// Params::PLAIN_BITS bits each. Plaintext (i, j) holds the j-th chunk of every
+// row in seal row i, batch encoded and transformed to NTT form at the first
+// data level, so the answer path can call multiply_plain on an NTT-form query
+// directly. The plaintexts are stored column by column, which is the order the
+// answer path reads them in.
+//
+// Before the first call to encode, set_value only writes the coefficients,
+// which makes bulk loading cheap. After that, the plaintexts are kept up to
+// date incrementally: set_value re-encodes only the SEAL_DB_COLUMNS plaintexts
+// of the seal row that contains the index, and growing the database encodes
+// only the new seal rows.
+template <typename Params>
+class BasicFastPIRDatabase {
+ public:
+  BasicFastPIRDatabase(seal::SEALContext sc)
+      : BasicFastPIRDatabase(
+            sc, PIRDatabase(seal::BatchEncoder(sc).slot_count(),
+                            Params::PLAIN_BITS)) {}
+
+  // uses the rows of db, e.g. a database file opened with PIRDatabase::open.
+  // db must have a block per seal row, and Params::PLAIN_BITS bits per
+  // coefficient.
+  BasicFastPIRDatabase(seal::SEALContext sc, PIRDatabase db)
+      : sc(sc),
+        batch_encoder(sc),
+        seal_slot_count(batch_encoder.slot_count()),
+        evaluator(sc),
+        db(std::move(db)),
+        columns(Params::SEAL_DB_COLUMNS) {
+    assert(this->db.plain_bits() == Params::PLAIN_BITS);
+    assert(this->db.blocks() == 0 ||
+           this->db.column_block(0, 0).size() == seal_slot_count);
+    assert(sc.first_context_data()->parms().plain_modulus().value() >
+           1ULL << Params::PLAIN_BITS);
+  }
+
+  auto db_rows() const -> size_t { return db.rows(); }
+
+  // number of seal rows covered by the encoded plaintexts
+  auto seal_db_rows() const -> size_t { return columns.front().size(); }
+
+  // true once encode has been called
+  auto is_encoded() const -> bool { return encoded; }
+
+  // grows the database to at least rows rows. new rows are all 0s.
+  auto allocate_to_max(size_t rows) -> void { allocate_to_max(rows, nullptr); }
+  auto allocate_to_max(size_t rows, asphr::ThreadPool& pool) -> void {
+    allocate_to_max(rows, &pool);
+  }
+
+  // writes the row, and re-encodes the plaintexts of its seal row if the
+  // database is encoded.
+  auto set_value(pir_index_t index, const pir_value_t& value) -> void {
+    set_value(index, value, nullptr);
+  }
+  auto set_value(pir_index_t index, const pir_value_t& value,
+                 asphr::ThreadPool& pool) -> void {
+    set_value(index, value, &pool);
+  }
+
+  auto get_value(pir_index_t index) const -> pir_value_t {
+    return db.get_value(index);
+  }
+
+  // (re-)encodes every plaintext, spread over the pool.
+  auto encode(asphr::ThreadPool& pool) -> void {
+    for (auto& column : columns) {
+      column.clear();
+    }
+    encode_new_seal_rows(&pool);
+    encoded = true;
+  }
+
+  // plaintext (seal_row, column), in NTT form
+  auto plaintext(size_t seal_row, size_t column) const
+      -> const seal::Plaintext& {
+    assert(seal_row < seal_db_rows());
+    assert(column < Params::SEAL_DB_COLUMNS);
+    return columns[column][seal_row];
+  }
+
+ private:
+  seal::SEALContext sc;
+  seal::BatchEncoder batch_encoder;
+  // number of slots in the plaintext
+  const size_t seal_slot_count;
+  seal::Evaluator evaluator;
+
+  // the coefficients of the rows, in blocks of seal_slot_count rows
+  PIRDatabase db;
+
+  // columns[j][i] is plaintext (i, j)
+  vector<vector<seal::Plaintext>> columns;
+  bool encoded = false;
+
+  auto allocate_to_max(size_t rows, asphr::ThreadPool* pool) -> void {
+    if (rows > db_rows()) {
+      db.allocate_to_max(rows);
+      if (encoded) {
+        encode_new_seal_rows(pool);
+      }
+    }
+  }
+
+  auto set_value(pir_index_t index, const pir_value_t& value,
+                 asphr::ThreadPool* pool) -> void {
+    allocate_to_max(static_cast<size_t>(index) + 1, pool);
+    db.set_value(index, value);
+    if (encoded) {
+      const size_t seal_row = index / seal_slot_count;
+      run_tasks(pool, Params::SEAL_DB_COLUMNS, [&](size_t j) {
+        encode_plaintext(seal_row, j, columns[j][seal_row]);
+      });
+    }
+  }
+
+  // encodes the seal rows that have been added since the last encoding
+  auto encode_new_seal_rows(asphr::ThreadPool* pool) -> void {
+    const size_t begin = seal_db_rows();
+    const size_t end = CEIL_DIV(db_rows(), seal_slot_count);
+    if (end <= begin) {
+      return;
+    }
+    for (auto& column : columns) {
+      column.resize(end);
+    }
+    const size_t new_seal_rows = end - begin;
+    run_tasks(pool, new_seal_rows * Params::SEAL_DB_COLUMNS, [&](size_t k) {
+      const size_t seal_row = begin + k % new_seal_rows;
+      const size_t j = k / new_seal_rows;
+      encode_plaintext(seal_row, j, columns[j][seal_row]);
+    });
+  }
+
+  // runs f(0), ..., f(n - 1), on the pool if there is one.
+  template <typename F>
+  static auto run_tasks(asphr::ThreadPool* pool, size_t n, F f) -> void {
+    if (pool != nullptr) {
+      pool->parallel_for(n, f);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        f(i);
+      }
+    }
+  }
+
+  auto encode_plaintext(size_t seal_row, size_t column, seal::Plaintext& plain)
+      -> void {
+    // the db is only read here, so the columns can be encoded in parallel
+    const auto coefficients = db.column_block(column, seal_row);
+    batch_encoder.encode(
+        gsl::span<const uint64_t>(coefficients.data(), coefficients.size()),
+        plain);
+    evaluator.transform_to_ntt_inplace(plain, sc.first_parms_id());
+  }
+};
+
+using FastPIRDatabase = BasicFastPIRDatabase<DefaultFastPIRParams>;
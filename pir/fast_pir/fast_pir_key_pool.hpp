@@ -0,0 +1,134 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <seal/seal.h>
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "asphr/asphr.hpp"
+
+struct Galois_string {
+  Galois_string(const string& s) : galois_string(s) {}
+
+  string galois_string;
+  auto save(std::ostream& os) const -> void { os << galois_string; }
+
+  // same interface as the seal objects, see FastPIRQuery::serialize_to_buffer
+  auto save_size() const -> size_t { return galois_string.size(); }
+  auto save(seal::seal_byte* out, size_t size) const -> size_t {
+    assert(size >= galois_string.size());
+    std::memcpy(out, galois_string.data(), galois_string.size());
+    return galois_string.size();
+  }
+};
+
+// struct of data needs to be switched each encryption
+struct keys {
+  seal::SecretKey secret_key;
+  Galois_string galois_keys;
+  // set by the client when it first uses the keys, and shared by all copies,
+  // so that decode can reuse it for every index that uses these keys.
+  shared_ptr<seal::Decryptor> decryptor = nullptr;
+};
+
+// KeyPool hands out fresh key pairs, which a background thread generates ahead
+// of time. Generating the galois keys is by far the most expensive part of a
+// query, so this takes it off the latency-critical path.
+//
+// Every key pair is handed out exactly once, so using one per query keeps the
+// protection against the pir replay attack. If the pool is empty, pop
+// generates a key pair on the calling thread instead of waiting. The pool holds
+// at most capacity key pairs, and a capacity of 0 disables the background
+// thread.
+class KeyPool {
+ public:
+  KeyPool(seal::SEALContext sc, size_t capacity)
+      : sc(sc), capacity(capacity) {
+    if (capacity > 0) {
+      generator = std::thread([this] { refill(); });
+    }
+  }
+
+  ~KeyPool() {
+    {
+      lock_guard<std::mutex> l(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    if (generator.joinable()) {
+      generator.join();
+    }
+  }
+
+  KeyPool(const KeyPool&) = delete;
+  auto operator=(const KeyPool&) -> KeyPool& = delete;
+
+  auto pop() -> keys {
+    {
+      lock_guard<std::mutex> l(mutex);
+      if (!pool.empty()) {
+        auto k = std::move(pool.front());
+        pool.pop_front();
+        cv.notify_one();
+        return k;
+      }
+    }
+    // this happens on every query when the client queries faster than the
+    // pool refills, so it is rate-limited
+    ASPHR_LOG_EVERY(DBG, absl::Seconds(10),
+                    "Key pool is empty, generating keys inline.", capacity,
+                    capacity);
+    return generate();
+  }
+
+  // number of key pairs ready to be popped
+  auto size() -> size_t {
+    lock_guard<std::mutex> l(mutex);
+    return pool.size();
+  }
+
+ private:
+  seal::SEALContext sc;
+  const size_t capacity;
+
+  // protects everything below
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<keys> pool;
+  bool stopping = false;
+
+  std::thread generator;
+
+  auto generate() -> keys {
+    ASPHR_SCOPED_TIMER("fast_pir_generate_keys_ns");
+    seal::KeyGenerator keygen(sc);
+    std::stringstream g_stream;
+    keygen.create_galois_keys().save(g_stream);
+    return keys{keygen.secret_key(), Galois_string(g_stream.str())};
+  }
+
+  auto refill() -> void {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> l(mutex);
+        cv.wait(l, [this] { return stopping || pool.size() < capacity; });
+        if (stopping) {
+          return;
+        }
+      }
+      auto k = generate();
+      {
+        lock_guard<std::mutex> l(mutex);
+        pool.push_back(std::move(k));
+      }
+    }
+  }
+};
@@ -0,0 +1,408 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+// An end-to-end load generator for PIR. It runs a local stand-in for the
+// server, which speaks the server.proto messages, and drives a number of
+// simulated clients through full rounds against it:
+//
+//   send:    the client writes a random row with SendMessage
+//   query:   the client builds and serializes a PIR query for a random row
+//   answer:  the server handles the ReceiveMessage request
+//   decode:  the client parses the answer and decodes the row
+//
+// and reports the throughput, the p50/p99/p999 latency of every stage and of
+// whole rounds, and the bytes on the wire. Every decoded row is checked against
+// the server's copy, so a broken change shows up as errors, not as a speedup.
+//
+// The rows of every round can be recorded with --record_trace, and replayed
+// with --replay_trace, so that two versions see the same load:
+//
+//   bazel run -c opt //pir/fast_pir:fast_pir_load --
+//     --clients=8 --rounds=20 --record_trace=/tmp/trace.txt
+//   bazel run -c opt //pir/fast_pir:fast_pir_load --
+//     --replay_trace=/tmp/trace.txt
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "asphr/asphr.hpp"
+#include "asphr/profiling.hpp"
+#include "fast_pir_client.hpp"
+#include "fast_pir_server.hpp"
+#include "schema/server.pb.h"
+
+ABSL_FLAG(size_t, clients, 4, "number of simulated clients");
+ABSL_FLAG(size_t, rounds, 10, "number of rounds per client");
+ABSL_FLAG(size_t, db_rows, POLY_MODULUS_DEGREE, "number of database rows");
+ABSL_FLAG(size_t, server_threads, std::thread::hardware_concurrency(),
+          "number of threads the server answers with");
+ABSL_FLAG(bool, compact_answers, false,
+          "whether to ask for answers in the compact format");
+ABSL_FLAG(string, record_trace, "",
+          "if set, the rows of every round are written to this file");
+ABSL_FLAG(string, replay_trace, "",
+          "if set, the rounds are read from this file, which was written with "
+          "--record_trace, instead of being drawn at random. --clients and "
+          "--rounds are ignored.");
+ABSL_FLAG(bool, profile, false,
+          "if set, the rounds are profiled with gperftools, which needs a "
+          "build with --define profiling=on");
+ABSL_FLAG(string, metrics_out, "",
+          "if set, the metrics of the run (see asphr/metrics.hpp) are written "
+          "to this file as JSON");
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// one round of one client. the trace file has one round per line, as
+// "client send_index receive_index".
+struct Round {
+  size_t client;
+  pir_index_t send_index;
+  pir_index_t receive_index;
+};
+
+auto random_rounds(size_t clients, size_t rounds, size_t db_rows)
+    -> vector<Round> {
+  absl::BitGen gen;
+  vector<Round> trace;
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t c = 0; c < clients; c++) {
+      trace.push_back(
+          {c, absl::Uniform<pir_index_t>(gen, 0, db_rows),
+           absl::Uniform<pir_index_t>(gen, 0, db_rows)});
+    }
+  }
+  return trace;
+}
+
+auto read_trace(const string& path) -> asphr::StatusOr<vector<Round>> {
+  std::ifstream in(path);
+  if (!in) {
+    return asphr::InvalidArgumentError(
+        asphr::StrCat("failed to open ", path));
+  }
+  vector<Round> trace;
+  Round round;
+  while (in >> round.client >> round.send_index >> round.receive_index) {
+    trace.push_back(round);
+  }
+  if (!in.eof()) {
+    return asphr::InvalidArgumentError(
+        asphr::StrCat(path, " is not a trace file"));
+  }
+  return trace;
+}
+
+auto write_trace(const string& path, const vector<Round>& trace)
+    -> asphr::Status {
+  std::ofstream out(path);
+  for (const auto& round : trace) {
+    out << round.client << " " << round.send_index << " "
+        << round.receive_index << "\n";
+  }
+  out.close();
+  if (!out) {
+    return absl::InternalError(asphr::StrCat("failed to write ", path));
+  }
+  return absl::OkStatus();
+}
+
+// the latencies of one stage, in microseconds, and the bytes it put on the
+// wire
+struct Stage {
+  vector<double> micros;
+  size_t bytes = 0;
+
+  auto add(Clock::time_point start, size_t wire_bytes = 0) -> void {
+    micros.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+    bytes += wire_bytes;
+  }
+
+  auto merge(const Stage& other) -> void {
+    micros.insert(micros.end(), other.micros.begin(), other.micros.end());
+    bytes += other.bytes;
+  }
+
+  // nearest rank. micros must be sorted.
+  auto percentile(double p) const -> double {
+    if (micros.empty()) {
+      return 0;
+    }
+    const auto rank = static_cast<size_t>(p * micros.size());
+    return micros[std::min(rank, micros.size() - 1)];
+  }
+};
+
+struct Stats {
+  Stage send;
+  Stage query;
+  Stage answer;
+  Stage decode;
+  Stage round;
+  size_t errors = 0;
+
+  auto merge(const Stats& other) -> void {
+    send.merge(other.send);
+    query.merge(other.query);
+    answer.merge(other.answer);
+    decode.merge(other.decode);
+    round.merge(other.round);
+    errors += other.errors;
+  }
+};
+
+// stands in for the server: it handles the SendMessage and ReceiveMessage
+// requests the way the real server does, minus the network, the
+// authentication and the acks. requests are handled one at a time, since answer
+// must not run concurrently with set_value; answer itself is spread over the
+// server's threads.
+class LocalServer {
+ public:
+  LocalServer(size_t db_rows, size_t num_threads)
+      : pir(DefaultFastPIRParams::create_context_params(), num_threads),
+        versions(db_rows, 0) {
+    pir.allocate_to_max(db_rows);
+    pir.encode_db();
+  }
+
+  auto send_message(const asphrserver::SendMessageInfo& request)
+      -> asphr::StatusOr<asphrserver::SendMessageResponse> {
+    if (request.message().size() != MESSAGE_SIZE) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("message has ", request.message().size(),
+                        " bytes, expected ", MESSAGE_SIZE));
+    }
+    pir_value_t value;
+    std::copy(request.message().begin(), request.message().end(),
+              value.begin());
+    std::lock_guard<std::mutex> l(mutex);
+    if (static_cast<size_t>(request.index()) >= pir.db_rows()) {
+      return asphr::InvalidArgumentError("index out of range");
+    }
+    pir.set_value(request.index(), value);
+    versions[request.index()]++;
+    return asphrserver::SendMessageResponse();
+  }
+
+  auto receive_message(const asphrserver::ReceiveMessageInfo& request)
+      -> asphr::StatusOr<asphrserver::ReceiveMessageResponse> {
+    std::lock_guard<std::mutex> l(mutex);
+    FastPIRServer::pir_query_t query;
+    try {
+      query = pir.query_from_string(request.pir_query());
+    } catch (const std::exception& e) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("failed to parse query: ", e.what()));
+    }
+    auto answer = pir.answer(query);
+    if (!answer.ok()) {
+      return answer.status();
+    }
+    asphrserver::ReceiveMessageResponse response;
+    response.set_pir_answer(request.compact_pir_answer()
+                                ? pir.answer_to_compact_string(*answer)
+                                : answer->serialize_to_string());
+    return response;
+  }
+
+  // the number of writes to row index so far
+  auto version(pir_index_t index) -> uint64_t {
+    std::lock_guard<std::mutex> l(mutex);
+    return versions.at(index);
+  }
+
+  // the row, and its version
+  auto get_value(pir_index_t index) -> pair<pir_value_t, uint64_t> {
+    std::lock_guard<std::mutex> l(mutex);
+    return {pir.get_value(index), versions.at(index)};
+  }
+
+ private:
+  std::mutex mutex;
+  FastPIRServer pir;
+  vector<uint64_t> versions;
+};
+
+// runs the rounds of one client, in order
+auto run_client(LocalServer& server, const vector<Round>& rounds,
+                size_t db_rows, bool compact_answers) -> Stats {
+  Stats stats;
+  FastPIRClient client;
+  absl::BitGen gen;
+  for (const auto& round : rounds) {
+    const auto round_start = Clock::now();
+
+    auto start = Clock::now();
+    asphrserver::SendMessageInfo send_request;
+    send_request.set_index(static_cast<int32_t>(round.send_index));
+    string message(MESSAGE_SIZE, '\0');
+    for (auto& c : message) {
+      c = static_cast<char>(absl::Uniform<byte>(gen));
+    }
+    send_request.set_message(std::move(message));
+    const auto send_response = server.send_message(send_request);
+    stats.send.add(start, send_request.ByteSizeLong());
+    if (!send_response.ok()) {
+      ASPHR_LOG_ERR("SendMessage failed.", status,
+                    send_response.status().ToString());
+      stats.errors++;
+      continue;
+    }
+
+    const auto version = server.version(round.receive_index);
+    start = Clock::now();
+    asphrserver::ReceiveMessageInfo receive_request;
+    auto [query, ticket] = client.query(round.receive_index, db_rows);
+    receive_request.set_pir_query(query.serialize_to_string());
+    receive_request.set_compact_pir_answer(compact_answers);
+    stats.query.add(start, receive_request.ByteSizeLong());
+
+    start = Clock::now();
+    const auto receive_response = server.receive_message(receive_request);
+    if (!receive_response.ok()) {
+      ASPHR_LOG_ERR("ReceiveMessage failed.", status,
+                    receive_response.status().ToString());
+      stats.errors++;
+      continue;
+    }
+    stats.answer.add(start, receive_response->ByteSizeLong());
+
+    start = Clock::now();
+    const auto& s = receive_response->pir_answer();
+    const auto answer = compact_answers ? client.answer_from_compact_string(s)
+                                        : client.answer_from_string(s);
+    const auto value = client.decode(answer, ticket);
+    stats.decode.add(start);
+    if (!value.ok()) {
+      ASPHR_LOG_ERR("Decode failed.", status, value.status().ToString());
+      stats.errors++;
+      continue;
+    }
+    stats.round.add(round_start);
+
+    // another client may have written the row while we were retrieving it,
+    // in which case we cannot tell which version we should have gotten
+    const auto [expected, expected_version] =
+        server.get_value(round.receive_index);
+    if (expected_version == version && *value != expected) {
+      ASPHR_LOG_ERR("Decoded the wrong row.", index, round.receive_index);
+      stats.errors++;
+    }
+  }
+  return stats;
+}
+
+auto print_stage(const string& name, Stage& stage, double seconds) -> void {
+  std::sort(stage.micros.begin(), stage.micros.end());
+  cout << absl::StrFormat("%-8s %8zu %10.1f %10.1f %10.1f %10.1f %12zu\n",
+                          name, stage.micros.size(),
+                          stage.percentile(0.5) / 1000,
+                          stage.percentile(0.99) / 1000,
+                          stage.percentile(0.999) / 1000,
+                          stage.micros.size() / seconds, stage.bytes);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const auto db_rows = absl::GetFlag(FLAGS_db_rows);
+
+  vector<Round> trace;
+  if (const auto path = absl::GetFlag(FLAGS_replay_trace); !path.empty()) {
+    auto read = read_trace(path);
+    if (!read.ok()) {
+      cerr << read.status() << endl;
+      return 1;
+    }
+    trace = std::move(*read);
+  } else {
+    trace = random_rounds(absl::GetFlag(FLAGS_clients),
+                          absl::GetFlag(FLAGS_rounds), db_rows);
+  }
+  if (const auto path = absl::GetFlag(FLAGS_record_trace); !path.empty()) {
+    if (const auto status = write_trace(path, trace); !status.ok()) {
+      cerr << status << endl;
+      return 1;
+    }
+  }
+
+  vector<vector<Round>> client_rounds;
+  for (const auto& round : trace) {
+    if (round.send_index >= db_rows || round.receive_index >= db_rows) {
+      cerr << "the trace has rows past --db_rows" << endl;
+      return 1;
+    }
+    if (round.client >= client_rounds.size()) {
+      client_rounds.resize(round.client + 1);
+    }
+    client_rounds[round.client].push_back(round);
+  }
+
+  cout << "setting up a database of " << db_rows << " rows" << endl;
+  LocalServer server(db_rows, absl::GetFlag(FLAGS_server_threads));
+
+  cout << "running " << trace.size() << " rounds on " << client_rounds.size()
+       << " clients" << endl;
+  const auto compact_answers = absl::GetFlag(FLAGS_compact_answers);
+  vector<Stats> client_stats(client_rounds.size());
+  const auto profile = absl::GetFlag(FLAGS_profile);
+  if (profile) {
+    const auto cpu = asphr::start_cpu_profile();
+    const auto heap = asphr::start_heap_profile();
+    if (!cpu.ok() || !heap.ok()) {
+      cerr << (cpu.ok() ? heap.status() : cpu.status()) << endl;
+      return 1;
+    }
+    cout << "profiling to " << *cpu << " and " << *heap << ".*.heap" << endl;
+  }
+  const auto start = Clock::now();
+  {
+    vector<std::jthread> threads;
+    for (size_t c = 0; c < client_rounds.size(); c++) {
+      threads.emplace_back([&, c] {
+        client_stats[c] =
+            run_client(server, client_rounds[c], db_rows, compact_answers);
+      });
+    }
+  }
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  if (profile) {
+    asphr::stop_cpu_profile().IgnoreError();
+    asphr::stop_heap_profile().IgnoreError();
+  }
+
+  Stats stats;
+  for (const auto& s : client_stats) {
+    stats.merge(s);
+  }
+  cout << absl::StrFormat("%-8s %8s %10s %10s %10s %10s %12s\n", "stage",
+                          "count", "p50 ms", "p99 ms", "p999 ms", "per s",
+                          "wire bytes");
+  print_stage("send", stats.send, seconds);
+  print_stage("query", stats.query, seconds);
+  print_stage("answer", stats.answer, seconds);
+  print_stage("decode", stats.decode, seconds);
+  print_stage("round", stats.round, seconds);
+  cout << absl::StrFormat("%.1f rounds/s, %zu errors\n",
+                          stats.round.micros.size() / seconds, stats.errors);
+  if (const auto path = absl::GetFlag(FLAGS_metrics_out); !path.empty()) {
+    if (const auto status =
+            asphr::write_metrics(path, asphr::MetricsFormat::json);
+        !status.ok()) {
+      cerr << status << endl;
+      return 1;
+    }
+  }
+  return stats.errors == 0 ? 0 : 1;
+}
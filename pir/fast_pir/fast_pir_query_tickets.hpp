@@ -0,0 +1,172 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <seal/seal.h>
+
+#include <algorithm>
+#include <map>
+
+#include "asphr/asphr.hpp"
+
+// number of queries a client can have in flight, i.e. queried but not yet
+// decoded, and how long it waits for their answers
+constexpr size_t CLIENT_QUERY_TICKETS = 64;
+constexpr absl::Duration CLIENT_QUERY_TICKET_TTL = absl::Minutes(10);
+
+// returned by the client's query functions, and handed back to decode with
+// the answer. a ticket can be decoded once.
+struct QueryTicket {
+  uint32_t slot = 0;
+  // distinguishes the tickets that used the same slot
+  uint32_t generation = 0;
+};
+
+// the bucket and the position in the bucket of each index of a batch query,
+// see fast_pir_batch.hpp
+using BatchPositions = std::map<pir_index_t, pair<size_t, size_t>>;
+
+// QueryTicketStore remembers what decode needs for every query in flight: the
+// index, or the batch positions of a batch query, and the decryptor of its
+// secret key. it never holds more than capacity queries, in slots that are
+// allocated once, so apart from the batch positions of the queries in flight
+// its memory stays constant however long the client runs. two queries for the
+// same index get different tickets, so they can overlap.
+//
+// a ticket expires after ttl, or when all slots are in use and a new query
+// needs one, in which case the query that expires first gives up its slot.
+// expired slots are freed by the next add.
+class QueryTicketStore {
+ public:
+  QueryTicketStore(size_t capacity, absl::Duration ttl)
+      : slots(std::max<size_t>(capacity, 1)), ttl(ttl) {}
+
+  auto add(pir_index_t index, shared_ptr<seal::Decryptor> decryptor)
+      -> QueryTicket {
+    auto [ticket, slot] = acquire(std::move(decryptor));
+    slot.index = index;
+    return ticket;
+  }
+
+  auto add_batch(BatchPositions positions,
+                 shared_ptr<seal::Decryptor> decryptor) -> QueryTicket {
+    auto [ticket, slot] = acquire(std::move(decryptor));
+    slot.batch = true;
+    slot.positions = std::move(positions);
+    return ticket;
+  }
+
+  // returns the index and the decryptor of the ticket, and frees its slot.
+  // fails if the ticket has expired or was already taken, or if it belongs to
+  // a batch query.
+  auto take(QueryTicket ticket)
+      -> asphr::StatusOr<pair<pir_index_t, shared_ptr<seal::Decryptor>>> {
+    auto slot = take_slot(ticket, false);
+    if (!slot.ok()) {
+      return slot.status();
+    }
+    return std::make_pair(slot->index, std::move(slot->decryptor));
+  }
+
+  // like take, for the ticket of a batch query
+  auto take_batch(QueryTicket ticket)
+      -> asphr::StatusOr<pair<BatchPositions, shared_ptr<seal::Decryptor>>> {
+    auto slot = take_slot(ticket, true);
+    if (!slot.ok()) {
+      return slot.status();
+    }
+    return std::make_pair(std::move(slot->positions),
+                          std::move(slot->decryptor));
+  }
+
+  // number of tickets that are neither decoded nor expired
+  auto size() const -> size_t {
+    const auto now = absl::Now();
+    return std::count_if(slots.begin(), slots.end(), [&](const Slot& slot) {
+      return slot.in_use && slot.expiry > now;
+    });
+  }
+
+  auto capacity() const -> size_t { return slots.size(); }
+
+ private:
+  struct Slot {
+    uint32_t generation = 0;
+    bool in_use = false;
+    bool batch = false;
+    pir_index_t index = 0;
+    BatchPositions positions;
+    absl::Time expiry;
+    shared_ptr<seal::Decryptor> decryptor;
+  };
+  vector<Slot> slots;
+  absl::Duration ttl;
+
+  // takes a free slot, or the one that expires first, for a new ticket
+  auto acquire(shared_ptr<seal::Decryptor> decryptor)
+      -> pair<QueryTicket, Slot&> {
+    const auto now = absl::Now();
+    size_t s = slots.size();
+    size_t oldest = 0;
+    for (size_t i = 0; i < slots.size(); i++) {
+      if (slots[i].in_use && slots[i].expiry <= now) {
+        free(slots[i]);
+      }
+      if (!slots[i].in_use) {
+        s = std::min(s, i);
+      } else if (slots[i].expiry < slots[oldest].expiry ||
+                 !slots[oldest].in_use) {
+        oldest = i;
+      }
+    }
+    if (s == slots.size()) {
+      ASPHR_LOG_EVERY(WARN, absl::Seconds(10),
+                      "All query tickets in use, evicting the oldest.",
+                      capacity, slots.size());
+      s = oldest;
+    }
+    auto& slot = slots[s];
+    free(slot);
+    slot.generation++;
+    slot.in_use = true;
+    slot.expiry = now + ttl;
+    slot.decryptor = std::move(decryptor);
+    return {QueryTicket{static_cast<uint32_t>(s), slot.generation}, slot};
+  }
+
+  auto take_slot(QueryTicket ticket, bool batch) -> asphr::StatusOr<Slot> {
+    if (ticket.slot >= slots.size()) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("query ticket slot ", ticket.slot, " out of range"));
+    }
+    auto& slot = slots[ticket.slot];
+    if (!slot.in_use || slot.generation != ticket.generation) {
+      return absl::NotFoundError(
+          "query ticket was already decoded, or has expired");
+    }
+    if (slot.batch != batch) {
+      return asphr::InvalidArgumentError(
+          batch ? "query ticket is not for a batch query"
+                : "query ticket is for a batch query");
+    }
+    const bool expired = slot.expiry <= absl::Now();
+    Slot result = std::move(slot);
+    free(slot);
+    if (expired) {
+      return absl::DeadlineExceededError("query ticket expired");
+    }
+    return result;
+  }
+
+  static auto free(Slot& slot) -> void {
+    slot.in_use = false;
+    slot.batch = false;
+    slot.positions.clear();
+    // the decryptor holds the secret key, which we do not want to keep around
+    // any longer than needed
+    slot.decryptor = nullptr;
+  }
+};
@@ -0,0 +1,434 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <mutex>
+
+#include "asphr/asphr.hpp"
+#include "fast_pir.hpp"
+#include "fast_pir_database.hpp"
+#include "galois_key_cache.hpp"
+
+// BasicFastPIRServer holds the database and computes the answers to PIR
+// queries, with the parameter set Params (see FastPIRParams). See
+// BasicFastPIRDatabase for the layout of the database.
+//
+// For every column j, the server computes the inner product of the query
+// ciphertexts with the plaintexts (i, j) over all seal rows i. This gives a
+// ciphertext with the j-th chunk of the requested row in the requested slot,
+// and 0 everywhere else. The column ciphertexts are then rotated by j and added
+// up, so the answer has chunk j in slot (slot + j) of the same matrix row. See
+// FastPIRClient::decode for the other side.
+//
+// Queries either carry their own galois keys, or are key-less and are answered
+// with the galois keys the client registered through register_galois_keys.
+// Compressed queries (see FastPIRCompressedQuery) are first expanded into a
+// plain query, and then answered the same way.
+//
+// The columns are spread over a work-stealing thread pool. The database
+// plaintexts are encoded ahead of time, either explicitly with encode_db or by
+// the first answer. After that, set_value and allocate_to_max only re-encode
+// the seal rows they touch. They must not be called concurrently with answer.
+// Answers are computed one at a time, in scratch ciphertexts that are reused
+// from one answer to the next.
+// With a file-backed database, they also throw std::system_error if the write
+// fails.
+template <typename Params>
+class BasicFastPIRServer {
+ public:
+  using pir_query_t = FastPIRQuery<seal::Ciphertext, seal::GaloisKeys>;
+  using pir_compressed_query_t = FastPIRCompressedQuery<seal::Ciphertext>;
+  using pir_answer_t = FastPIRAnswer;
+
+  BasicFastPIRServer() : BasicFastPIRServer(Params::create_context_params()) {
+    ASPHR_LOG_INFO("Creating FastPIRServer.", from, "base");
+  }
+
+  // a set of galois keys is several MB, so galois_key_cache_capacity bounds
+  // the memory that registered keys can take up.
+  BasicFastPIRServer(seal::SEALContext sc,
+                     size_t num_threads = std::thread::hardware_concurrency(),
+                     size_t galois_key_cache_capacity = 1'000)
+      : BasicFastPIRServer(sc,
+                           PIRDatabase(Params::POLY_MODULUS_DEGREE,
+                                       Params::PLAIN_BITS),
+                           num_threads, galois_key_cache_capacity) {}
+
+  // serves the rows of db, e.g. a database file opened with
+  // PIRDatabase::open, so that a restarted server does not have to load every
+  // row again.
+  //
+  // the constructors throw std::invalid_argument if sc was not created from
+  // Params, see checked_context.
+  BasicFastPIRServer(seal::SEALContext sc, PIRDatabase db,
+                     size_t num_threads = std::thread::hardware_concurrency(),
+                     size_t galois_key_cache_capacity = 1'000)
+      : sc(checked_context<Params>(sc)),
+        evaluator(sc),
+        pool(num_threads),
+        db(sc, std::move(db)),
+        galois_key_cache(sc, galois_key_cache_capacity) {
+    for (size_t i = 0; i < pool.size(); i++) {
+      memory_pools.push_back(seal::MemoryPoolHandle::New());
+      product_scratch.emplace_back(memory_pools.back());
+      column_scratch.emplace_back(memory_pools.back());
+    }
+    ASPHR_LOG_INFO("Creating FastPIRServer.", from, "context params", threads,
+                   pool.size());
+  }
+
+  auto db_rows() const -> size_t { return db.db_rows(); }
+
+  // grows the database to at least rows rows. new rows are all 0s.
+  auto allocate_to_max(size_t rows) -> void {
+    db.allocate_to_max(rows, pool);
+  }
+
+  auto set_value(pir_index_t index, const pir_value_t& value) -> void {
+    db.set_value(index, value, pool);
+  }
+
+  auto get_value(pir_index_t index) const -> pir_value_t {
+    return db.get_value(index);
+  }
+
+  // encodes the database, if it isn't already.
+  auto encode_db() -> void {
+    std::lock_guard lock(answer_mutex);
+    encode_db_locked();
+  }
+
+  // loads the query ciphertexts in parallel.
+  // throws if deserialization fails
+  auto query_from_string(std::string_view s) noexcept(false) -> pir_query_t {
+    pir_query_t query;
+    query.deserialize_from_string(s, sc, &pool);
+    return query;
+  }
+
+  // throws if deserialization fails
+  auto query_from_string_without_keys(std::string_view s) noexcept(false)
+      -> pir_query_t {
+    pir_query_t query;
+    query.deserialize_from_string_without_keys(s, sc, &pool);
+    return query;
+  }
+
+  // the compact wire format, see FastPIRAnswer::serialize_to_compact_string
+  // throws if serialization fails
+  auto answer_to_compact_string(const pir_answer_t& answer) const
+      noexcept(false) -> string {
+    return answer.serialize_to_compact_string(sc);
+  }
+
+  // returns a reader for a query in the streaming wire format
+  auto query_stream_reader() const -> FastPIRQueryStreamReader {
+    return FastPIRQueryStreamReader(sc);
+  }
+
+  // throws if deserialization fails
+  auto compressed_query_from_string(std::string_view s) noexcept(false)
+      -> pir_compressed_query_t {
+    pir_compressed_query_t query;
+    query.deserialize_from_string(s, sc, &pool);
+    return query;
+  }
+
+  // registers the galois keys used to answer key-less queries from client_id,
+  // replacing any keys it registered before. compressed queries also need the
+  // relin keys.
+  auto register_galois_keys(const string& client_id,
+                            const string& serialized_keys,
+                            const string& serialized_relin_keys = "")
+      -> asphr::Status {
+    return galois_key_cache.register_keys(client_id, serialized_keys,
+                                          serialized_relin_keys);
+  }
+
+  // answers a query that carries its own galois keys
+  auto answer(const pir_query_t& query) -> asphr::StatusOr<pir_answer_t> {
+    std::lock_guard lock(answer_mutex);
+    return compute_answer(query.query, query.galois_keys);
+  }
+
+  // answers the query ciphertexts of a key-less query with the given galois
+  // keys
+  auto answer(const vector<seal::Ciphertext>& query,
+              const seal::GaloisKeys& galois_keys)
+      -> asphr::StatusOr<pir_answer_t> {
+    std::lock_guard lock(answer_mutex);
+    return compute_answer(query, galois_keys);
+  }
+
+  // answers a key-less query with the galois keys registered for client_id
+  auto answer(const pir_query_t& query, const string& client_id)
+      -> asphr::StatusOr<pir_answer_t> {
+    const auto keys = galois_key_cache.get(client_id);
+    if (keys == nullptr) {
+      return absl::NotFoundError(
+          asphr::StrCat("no galois keys registered for client ", client_id));
+    }
+    std::lock_guard lock(answer_mutex);
+    return compute_answer(query.query, keys->galois_keys);
+  }
+
+  // answers a compressed query with the keys registered for client_id
+  auto answer(const pir_compressed_query_t& query, const string& client_id)
+      -> asphr::StatusOr<pir_answer_t> {
+    if (!supports_compressed_queries(sc)) {
+      return absl::FailedPreconditionError(
+          "the encryption parameters are too small for compressed queries");
+    }
+    const auto keys = galois_key_cache.get(client_id);
+    if (keys == nullptr || !keys->relin_keys.has_value()) {
+      return absl::NotFoundError(asphr::StrCat(
+          "no galois and relin keys registered for client ", client_id));
+    }
+
+    std::lock_guard lock(answer_mutex);
+    encode_db_locked();
+    const auto seal_db_rows = db.seal_db_rows();
+    // the expansion can separate at most all N coefficients
+    const size_t n = sc.first_context_data()->parms().poly_modulus_degree();
+    if (query.expansion_depth > static_cast<uint32_t>(std::countr_zero(n))) {
+      return asphr::InvalidArgumentError(asphr::StrCat(
+          "expansion depth ", query.expansion_depth, " is too large"));
+    }
+    const size_t rows_per_selector = size_t{1} << query.expansion_depth;
+    if (query.row_selectors.size() * rows_per_selector < seal_db_rows) {
+      return asphr::InvalidArgumentError(asphr::StrCat(
+          "compressed query covers ",
+          query.row_selectors.size() * rows_per_selector,
+          " seal rows but the database has ", seal_db_rows, " seal rows"));
+    }
+
+    vector<seal::Ciphertext> plain_query;
+    try {
+      plain_query.reserve(seal_db_rows);
+      for (size_t i = 0; plain_query.size() < seal_db_rows; i++) {
+        auto expanded = expand_query(
+            query.row_selectors.at(i), query.expansion_depth,
+            std::min(rows_per_selector, seal_db_rows - plain_query.size()),
+            keys->galois_keys);
+        for (auto& c : expanded) {
+          plain_query.push_back(std::move(c));
+        }
+      }
+      // every expanded selector encrypts the constant 0 or 1, so multiplying
+      // it with the slot selector gives the plain query ciphertext.
+      pool.parallel_for(seal_db_rows, [&](size_t i) {
+        evaluator.multiply_inplace(plain_query.at(i), query.slot_selector);
+        evaluator.relinearize_inplace(plain_query.at(i),
+                                      keys->relin_keys.value());
+      });
+    } catch (const std::exception& e) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("failed to expand query: ", e.what()));
+    }
+    return compute_answer(plain_query, keys->galois_keys);
+  }
+
+ private:
+  seal::SEALContext sc;
+  seal::Evaluator evaluator;
+  asphr::ThreadPool pool;
+  // worker i of pool allocates its seal objects from memory_pools[i] rather
+  // than from seal's global pool, so that the workers do not contend for it,
+  // and the memory of one answer is reused by the next.
+  vector<seal::MemoryPoolHandle> memory_pools;
+  // per worker
+  vector<seal::Ciphertext> product_scratch;
+  vector<seal::Ciphertext> column_scratch;
+  // held while the database is encoded, and for the whole of an answer. the
+  // pool runs one parallel_for at a time anyway, so serializing the answers
+  // costs little.
+  std::mutex answer_mutex;
+  // the ntt query and the block answers of compute_answer. they keep their
+  // memory between answers, so after the first answer only the returned
+  // ciphertext is allocated.
+  vector<seal::Ciphertext> query_ntt_scratch;
+  vector<seal::Ciphertext> block_scratch;
+  BasicFastPIRDatabase<Params> db;
+  GaloisKeyCache galois_key_cache;
+
+  // the caller holds answer_mutex
+  auto encode_db_locked() -> void {
+    if (!db.is_encoded()) {
+      db.encode(pool);
+    }
+  }
+
+  // the caller holds answer_mutex
+  auto compute_answer(const vector<seal::Ciphertext>& query,
+                      const seal::GaloisKeys& galois_keys)
+      -> asphr::StatusOr<pir_answer_t> {
+    ASPHR_SCOPED_TIMER("fast_pir_server_answer_ns");
+    encode_db_locked();
+    const auto seal_db_rows = db.seal_db_rows();
+    if (seal_db_rows == 0) {
+      return asphr::InvalidArgumentError("the database is empty");
+    }
+    // the client only knows an upper bound on the database size, so the query
+    // may be longer than the database. the extra rows are all 0s.
+    if (query.size() < seal_db_rows) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("query has ", query.size(),
+                        " ciphertexts but the database has ", seal_db_rows,
+                        " seal rows"));
+    }
+
+    try {
+      auto& query_ntt = grow_scratch(query_ntt_scratch, seal_db_rows);
+      pool.parallel_for(seal_db_rows, [&](size_t i) {
+        evaluator.transform_to_ntt(query.at(i), query_ntt.at(i));
+      });
+
+      // each task handles a contiguous block of columns. within a block we
+      // rotate with Horner's rule, so that every column only needs a single
+      // rotation by 1, and then rotate the whole block into place.
+      constexpr size_t COLUMNS = Params::SEAL_DB_COLUMNS;
+      const size_t block_size = CEIL_DIV(COLUMNS, 4 * pool.size());
+      const size_t num_blocks = CEIL_DIV(COLUMNS, block_size);
+      auto& block_answers = grow_scratch(block_scratch, num_blocks);
+      pool.parallel_for_worker(num_blocks, [&](size_t worker, size_t b) {
+        const auto& memory_pool = memory_pools.at(worker);
+        const size_t start = b * block_size;
+        const size_t end = std::min(start + block_size, COLUMNS);
+        auto& block_answer = block_answers.at(b);
+        auto& column = column_scratch.at(worker);
+        column_answer(query_ntt, seal_db_rows, end - 1, worker, block_answer);
+        for (size_t j = end - 1; j-- > start;) {
+          evaluator.rotate_rows_inplace(block_answer, -1, galois_keys,
+                                        memory_pool);
+          column_answer(query_ntt, seal_db_rows, j, worker, column);
+          evaluator.add_inplace(block_answer, column);
+        }
+        if (start > 0) {
+          evaluator.rotate_rows_inplace(block_answer,
+                                        -static_cast<int>(start), galois_keys,
+                                        memory_pool);
+        }
+      });
+
+      for (size_t b = 1; b < num_blocks; b++) {
+        evaluator.add_inplace(block_answers.at(0), block_answers.at(b));
+      }
+      // copied out of the scratch, since the answer outlives the lock
+      seal::Ciphertext answer = block_answers.at(0);
+      finalize_answer(answer);
+      return pir_answer_t{answer};
+    } catch (const std::exception& e) {
+      // SEAL throws if the query does not match our parameters, or if the
+      // galois keys are missing a rotation.
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("failed to answer query: ", e.what()));
+    }
+  }
+
+  // obliviously expands a ciphertext encrypting 2^-depth * x^k into count
+  // ciphertexts, where the k-th one encrypts 1 and all others encrypt 0. this
+  // is the expansion from SealPIR: level a splits every ciphertext into the
+  // even and the odd coefficients of x^(2^a), using the automorphism
+  // x -> x^(N/2^a + 1), which negates exactly the odd ones. after the last
+  // level, ciphertext k holds coefficient k. branches that end at an index >=
+  // count are skipped.
+  auto expand_query(const seal::Ciphertext& encrypted, uint32_t depth,
+                    size_t count, const seal::GaloisKeys& galois_keys)
+      -> vector<seal::Ciphertext> {
+    const size_t n = encrypted.poly_modulus_degree();
+    vector<seal::Ciphertext> expanded = {encrypted};
+    for (uint32_t a = 0; a < depth; a++) {
+      const uint32_t galois_elt = static_cast<uint32_t>((n >> a) + 1);
+      // x^(2n - 2^a) = x^(-2^a)
+      const size_t shift = 2 * n - (size_t{1} << a);
+      const size_t shift_rotated = (shift * galois_elt) % (2 * n);
+      const size_t size = expanded.size();
+      vector<seal::Ciphertext> next(std::min(2 * size, count));
+      pool.parallel_for_worker(size, [&](size_t worker, size_t b) {
+        auto rotated = expanded.at(b);
+        evaluator.apply_galois_inplace(rotated, galois_elt, galois_keys,
+                                       memory_pools.at(worker));
+        if (b + size < next.size()) {
+          auto shifted = multiply_power_of_x(expanded.at(b), shift);
+          evaluator.add(shifted, multiply_power_of_x(rotated, shift_rotated),
+                        next.at(b + size));
+        }
+        evaluator.add(expanded.at(b), rotated, next.at(b));
+      });
+      expanded = std::move(next);
+    }
+    return expanded;
+  }
+
+  // multiplies encrypted by x^k in the ring Z_q[x]/(x^N + 1)
+  auto multiply_power_of_x(const seal::Ciphertext& encrypted, size_t k) const
+      -> seal::Ciphertext {
+    const auto& coeff_modulus =
+        sc.get_context_data(encrypted.parms_id())->parms().coeff_modulus();
+    const size_t n = encrypted.poly_modulus_degree();
+    seal::Ciphertext result = encrypted;
+    for (size_t poly = 0; poly < encrypted.size(); poly++) {
+      for (size_t m = 0; m < coeff_modulus.size(); m++) {
+        const uint64_t q = coeff_modulus[m].value();
+        const uint64_t* src = encrypted.data(poly) + m * n;
+        uint64_t* dst = result.data(poly) + m * n;
+        for (size_t j = 0; j < n; j++) {
+          // x^N = -1
+          const size_t target = (j + k) % (2 * n);
+          if (target < n) {
+            dst[target] = src[j];
+          } else {
+            dst[target - n] = src[j] == 0 ? 0 : q - src[j];
+          }
+        }
+      }
+    }
+    return result;
+  }
+
+  // mod-switches the answer to the last level, which makes it smaller on the
+  // wire. with the default parameters the data level is already the last
+  // level, so this does nothing.
+  auto finalize_answer(seal::Ciphertext& answer) -> void {
+    if (answer.parms_id() != sc.last_parms_id()) {
+      evaluator.mod_switch_to_inplace(answer, sc.last_parms_id());
+    }
+  }
+
+  // grows scratch to at least size ciphertexts, spread over the worker pools
+  auto grow_scratch(vector<seal::Ciphertext>& scratch, size_t size)
+      -> vector<seal::Ciphertext>& {
+    while (scratch.size() < size) {
+      const size_t worker = scratch.size() % memory_pools.size();
+      scratch.emplace_back(memory_pools.at(worker));
+    }
+    return scratch;
+  }
+
+  // computes sum_{i < rows} query_ntt[i] * plaintext(i, column) into result,
+  // out of NTT form, on pool worker worker. result keeps its memory if it
+  // already has the right size.
+  auto column_answer(const vector<seal::Ciphertext>& query_ntt, size_t rows,
+                     size_t column, size_t worker, seal::Ciphertext& result)
+      -> void {
+    const auto& memory_pool = memory_pools.at(worker);
+    auto& product = product_scratch.at(worker);
+    for (size_t i = 0; i < rows; i++) {
+      const auto& plain = db.plaintext(i, column);
+      if (i == 0) {
+        evaluator.multiply_plain(query_ntt[i], plain, result, memory_pool);
+      } else {
+        evaluator.multiply_plain(query_ntt[i], plain, product, memory_pool);
+        evaluator.add_inplace(result, product);
+      }
+    }
+    evaluator.transform_from_ntt_inplace(result);
+  }
+};
+
+using FastPIRServer = BasicFastPIRServer<DefaultFastPIRParams>;
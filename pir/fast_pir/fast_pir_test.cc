@@ -0,0 +1,697 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include "fast_pir_batch_server.hpp"
+#include "fast_pir_client.hpp"
+#include "fast_pir_server.hpp"
+
+namespace {
+auto random_value(absl::BitGen& gen) -> pir_value_t {
+  pir_value_t value;
+  for (auto& b : value) {
+    b = absl::Uniform<byte>(gen);
+  }
+  return value;
+}
+}  // namespace
+
+TEST(FastPIR, PIRDatabaseLayout) {
+  const size_t block_rows = 8;
+  PIRDatabase db(block_rows);
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < 11; i++) {
+    values.push_back(random_value(gen));
+    db.set_value(i, values.back());
+  }
+  EXPECT_EQ(db.rows(), 11);
+  EXPECT_EQ(db.blocks(), 2);
+
+  // the second block is padded with 0s
+  vector<byte> row_major(2 * block_rows * MESSAGE_SIZE, byte(0));
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(db.get_value(i), values[i]);
+    std::copy(values[i].begin(), values[i].end(),
+              row_major.begin() + i * MESSAGE_SIZE);
+  }
+  for (size_t block = 0; block < db.blocks(); block++) {
+    for (size_t j = 0; j < SEAL_DB_COLUMNS; j++) {
+      const auto expected = get_submatrix_as_uint64s(
+          row_major, MESSAGE_SIZE_BITS,
+          block * block_rows * MESSAGE_SIZE_BITS + j * PLAIN_BITS, PLAIN_BITS,
+          block_rows);
+      const auto column = db.column_block(j, block);
+      EXPECT_EQ(vector<uint64_t>(column.begin(), column.end()), expected);
+    }
+  }
+}
+
+TEST(FastPIR, PIRDatabaseColumnAlignment) {
+  // 5 rows of 8 bytes are padded to a cache line
+  const size_t block_rows = 5;
+  PIRDatabase db(block_rows);
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < 11; i++) {
+    values.push_back(random_value(gen));
+    db.set_value(i, values.back());
+  }
+  for (size_t block = 0; block < db.blocks(); block++) {
+    for (size_t j = 0; j < db.columns(); j++) {
+      const auto column = db.column_block(j, block);
+      EXPECT_EQ(column.size(), block_rows);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(column.data()) %
+                    PIRDatabase::COLUMN_ALIGNMENT,
+                0);
+    }
+  }
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(db.get_value(i), values[i]);
+  }
+  EXPECT_TRUE(db.verify().ok());
+}
+
+TEST(FastPIR, PIRDatabaseFile) {
+  const string path = ::testing::TempDir() + "/pir_database_file";
+  std::filesystem::remove(path);
+  const size_t block_rows = 8;
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  {
+    auto db = PIRDatabase::open(path, block_rows);
+    ASSERT_TRUE(db.ok()) << db.status();
+    EXPECT_TRUE(db->is_file_backed());
+    EXPECT_EQ(db->rows(), 0);
+    for (size_t i = 0; i < 11; i++) {
+      values.push_back(random_value(gen));
+      db->set_value(i, values.back());
+    }
+  }
+
+  auto db = PIRDatabase::open(path, block_rows);
+  ASSERT_TRUE(db.ok()) << db.status();
+  EXPECT_EQ(db->rows(), 11);
+  EXPECT_TRUE(db->verify().ok());
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(db->get_value(i), values[i]);
+  }
+
+  // a database file only works with the layout it was written with
+  EXPECT_EQ(PIRDatabase::open(path, 2 * block_rows).status().code(),
+            absl::StatusCode::kFailedPrecondition);
+  {
+    // flip a bit of row 3
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(4096 + 3 * sizeof(uint64_t));
+    const auto c = static_cast<char>(file.get());
+    file.seekp(4096 + 3 * sizeof(uint64_t));
+    file.put(static_cast<char>(c ^ 1));
+  }
+  EXPECT_EQ(db->verify().code(), absl::StatusCode::kDataLoss);
+  std::filesystem::remove(path);
+}
+
+TEST(FastPIR, PIRDatabaseLogReplay) {
+  const string path = ::testing::TempDir() + "/pir_database_log";
+  const string crashed = ::testing::TempDir() + "/pir_database_log_crashed";
+  for (const auto& p : {path, path + ".log", crashed, crashed + ".log"}) {
+    std::filesystem::remove(p);
+  }
+  const size_t block_rows = 8;
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  {
+    auto db = PIRDatabase::open(path, block_rows);
+    ASSERT_TRUE(db.ok()) << db.status();
+    db->allocate_to_max(11);
+    // the file as if the process crashed before any of the rows below were
+    // written back, with only the log to show for them
+    std::filesystem::copy_file(path, crashed);
+    for (size_t i = 0; i < 11; i++) {
+      values.push_back(random_value(gen));
+      db->set_value(i, values.back());
+    }
+    std::filesystem::copy_file(path + ".log", crashed + ".log");
+  }
+  // the last record was torn by the crash
+  {
+    std::ofstream log(crashed + ".log", std::ios::app | std::ios::binary);
+    log << string(100, 'x');
+  }
+
+  auto db = PIRDatabase::open(crashed, block_rows);
+  ASSERT_TRUE(db.ok()) << db.status();
+  EXPECT_TRUE(db->verify().ok());
+  for (size_t i = 0; i < values.size(); i++) {
+    EXPECT_EQ(db->get_value(i), values[i]);
+  }
+  // a clean close leaves no log behind
+  EXPECT_FALSE(std::filesystem::exists(path + ".log"));
+  for (const auto& p : {path, crashed}) {
+    std::filesystem::remove(p);
+  }
+}
+
+TEST(FastPIR, PIRDatabaseCheckpointDuringWrites) {
+  const string path = ::testing::TempDir() + "/pir_database_checkpoint";
+  for (const auto& p : {path, path + ".log", path + ".log.old"}) {
+    std::filesystem::remove(p);
+  }
+  const size_t block_rows = 8;
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  {
+    auto db = PIRDatabase::open(path, block_rows);
+    ASSERT_TRUE(db.ok()) << db.status();
+    std::atomic<bool> done = false;
+    std::thread checkpointer([&] {
+      while (!done) {
+        db->checkpoint();
+      }
+    });
+    for (size_t i = 0; i < 200; i++) {
+      values.push_back(random_value(gen));
+      db->set_value(i % 50, values.back());
+    }
+    done = true;
+    checkpointer.join();
+    // every row is in the log or in the file, so a crash now loses nothing:
+    // the file as the last checkpoint left it, plus the logs
+    const string crashed = path + "_crashed";
+    std::filesystem::remove(crashed);
+    std::filesystem::copy_file(path, crashed);
+    for (const auto& log : {string(".log"), string(".log.old")}) {
+      std::filesystem::remove(crashed + log);
+      if (std::filesystem::exists(path + log)) {
+        std::filesystem::copy_file(path + log, crashed + log);
+      }
+    }
+    auto recovered = PIRDatabase::open(crashed, block_rows);
+    ASSERT_TRUE(recovered.ok()) << recovered.status();
+    EXPECT_TRUE(recovered->verify().ok());
+    for (size_t i = 150; i < 200; i++) {
+      EXPECT_EQ(recovered->get_value(i % 50), values[i]);
+    }
+  }
+  auto db = PIRDatabase::open(path, block_rows);
+  ASSERT_TRUE(db.ok()) << db.status();
+  EXPECT_TRUE(db->verify().ok());
+  for (size_t i = 150; i < 200; i++) {
+    EXPECT_EQ(db->get_value(i % 50), values[i]);
+  }
+  for (const auto& p : {path, path + "_crashed"}) {
+    std::filesystem::remove(p);
+  }
+}
+
+TEST(FastPIR, ServeDatabaseFile) {
+  const string path = ::testing::TempDir() + "/serve_database_file";
+  std::filesystem::remove(path);
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  {
+    auto db = PIRDatabase::open(path);
+    ASSERT_TRUE(db.ok()) << db.status();
+    for (size_t i = 0; i < 5; i++) {
+      values.push_back(random_value(gen));
+      db->set_value(static_cast<pir_index_t>(i * 1000), values.back());
+    }
+  }
+
+  // a restarted server answers from the file, without loading any rows
+  auto db = PIRDatabase::open(path);
+  ASSERT_TRUE(db.ok()) << db.status();
+  FastPIRServer server(create_context_params(), *std::move(db), 2);
+  FastPIRClient client;
+  EXPECT_EQ(server.db_rows(), 4001);
+  for (size_t i = 0; i < values.size(); i++) {
+    const auto index = static_cast<pir_index_t>(i * 1000);
+    auto [query, ticket] = client.query(index, POLY_MODULUS_DEGREE);
+    auto server_query = server.query_from_string(query.serialize_to_string());
+    auto answer = server.answer(server_query);
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values[i]);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(FastPIR, QueryAnswerDecode) {
+  // three seal rows, the last one only partially filled
+  const size_t db_rows = 2 * POLY_MODULUS_DEGREE + 10;
+  // the client only knows an upper bound on the database size
+  const size_t client_db_rows = 4 * POLY_MODULUS_DEGREE;
+
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  // slots 0, N/2 - 1, N - 1 and N/2 cover both rows of the slot matrix, and
+  // the last index is in the partially filled seal row.
+  for (pir_index_t index : {0, 2047, 4095, 4096 + 2048, 2 * 4096 + 9}) {
+    auto [query, ticket] = client.query(index, client_db_rows);
+    auto server_query = server.query_from_string(query.serialize_to_string());
+    auto answer = server.answer(server_query);
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values.at(index));
+  }
+}
+
+TEST(FastPIR, Params8192) {
+  using Params = FastPIRParams8192;
+  const size_t db_rows = Params::POLY_MODULUS_DEGREE + 10;
+  seal::SEALContext sc(Params::create_context_params());
+  BasicFastPIRServer<Params> server(sc, 2);
+  BasicFastPIRClient<Params> client(sc);
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  for (pir_index_t index : {0, 4095, 4096, 8191, 8192 + 9}) {
+    auto [query, ticket] = client.query(index, db_rows);
+    auto server_query = server.query_from_string(query.serialize_to_string());
+    auto answer = server.answer(server_query);
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values.at(index));
+  }
+}
+
+TEST(FastPIR, RejectsContextOfOtherParams) {
+  const seal::SEALContext sc(FastPIRParams8192::create_context_params());
+  EXPECT_THROW(FastPIRServer(sc, 1), std::invalid_argument);
+  EXPECT_THROW(FastPIRClient{sc}, std::invalid_argument);
+}
+
+TEST(FastPIR, RejectsShortQuery) {
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+  server.allocate_to_max(2 * POLY_MODULUS_DEGREE);
+
+  auto query = client.query(0, POLY_MODULUS_DEGREE).first;
+  auto server_query = server.query_from_string(query.serialize_to_string());
+  EXPECT_FALSE(server.answer(server_query).ok());
+}
+
+TEST(FastPIR, AnswerAfterSetValue) {
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+  server.allocate_to_max(POLY_MODULUS_DEGREE + 1);
+  server.encode_db();
+
+  // the first index is in an already encoded seal row, the second one grows
+  // the database by a seal row.
+  absl::BitGen gen;
+  const vector<pir_index_t> indices = {POLY_MODULUS_DEGREE - 1,
+                                       2 * POLY_MODULUS_DEGREE + 5};
+  vector<pir_value_t> values;
+  for (auto index : indices) {
+    values.push_back(random_value(gen));
+    server.set_value(index, values.back());
+  }
+
+  for (size_t i = 0; i < indices.size(); i++) {
+    auto [query, ticket] = client.query(indices[i], 3 * POLY_MODULUS_DEGREE);
+    auto answer =
+        server.answer(server.query_from_string(query.serialize_to_string()));
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values[i]);
+  }
+}
+
+TEST(FastPIR, KeylessQuery) {
+  const size_t db_rows = POLY_MODULUS_DEGREE + 1;
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  EXPECT_EQ(client.query_without_keys(3, db_rows).status().code(),
+            absl::StatusCode::kFailedPrecondition);
+  ASSERT_TRUE(server
+                  .register_galois_keys("client",
+                                        client.galois_keys_for_registration())
+                  .ok());
+
+  for (pir_index_t index : {size_t{3}, POLY_MODULUS_DEGREE}) {
+    auto keyless_query = client.query_without_keys(index, db_rows);
+    ASSERT_TRUE(keyless_query.ok()) << keyless_query.status();
+    auto& [query, ticket] = keyless_query.value();
+    auto server_query = server.query_from_string_without_keys(
+        query.serialize_to_string_without_keys());
+
+    EXPECT_EQ(server.answer(server_query, "someone else").status().code(),
+              absl::StatusCode::kNotFound);
+
+    auto answer = server.answer(server_query, "client");
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values.at(index));
+  }
+}
+
+TEST(FastPIR, ParallelQuery) {
+  const size_t db_rows = 3 * POLY_MODULUS_DEGREE;
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+  client.set_query_threads(3);
+
+  absl::BitGen gen;
+  const pir_index_t index = 2 * POLY_MODULUS_DEGREE + 17;
+  const auto value = random_value(gen);
+  server.allocate_to_max(db_rows);
+  server.set_value(index, value);
+
+  auto [query, ticket] = client.query(index, db_rows);
+  EXPECT_EQ(query.query.size(), 3);
+  auto answer =
+      server.answer(server.query_from_string(query.serialize_to_string()));
+  ASSERT_TRUE(answer.ok()) << answer.status();
+  auto client_answer = client.answer_from_string(answer->serialize_to_string());
+  EXPECT_EQ(client.decode(client_answer, ticket).value(), value);
+}
+
+TEST(FastPIR, CompressedQuery) {
+  // the default parameters are too small for compressed queries
+  using Params = FastPIRParams8192;
+  const size_t n = Params::POLY_MODULUS_DEGREE;
+  const seal::SEALContext sc(Params::create_context_params());
+  ASSERT_TRUE(supports_compressed_queries(sc));
+
+  // three seal rows, so the expansion has depth 2 and one branch is pruned
+  const size_t db_rows = 2 * n + 10;
+  BasicFastPIRServer<Params> server(sc, 2);
+  BasicFastPIRClient<Params> client(sc);
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  const auto [galois_keys, relin_keys] =
+      client.compressed_keys_for_registration();
+  ASSERT_TRUE(
+      server.register_galois_keys("client", galois_keys, relin_keys).ok());
+
+  for (pir_index_t index : {size_t{0}, n + n / 2, 2 * n + 9}) {
+    auto query_and_ticket = client.query_compressed(index, 4 * n);
+    ASSERT_TRUE(query_and_ticket.ok()) << query_and_ticket.status();
+    auto& [query, ticket] = *query_and_ticket;
+    EXPECT_EQ(query.row_selectors.size(), 1);
+    auto server_query =
+        server.compressed_query_from_string(query.serialize_to_string());
+    auto answer = server.answer(server_query, "client");
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    auto client_answer =
+        client.answer_from_string(answer->serialize_to_string());
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values.at(index));
+  }
+}
+
+TEST(FastPIR, CompressedQueryNeedsLargeParameters) {
+  FastPIRClient client;
+  client.compressed_keys_for_registration();
+  EXPECT_EQ(client.query_compressed(0, POLY_MODULUS_DEGREE).status().code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(FastPIR, KeyPool) {
+  const seal::SEALContext sc(create_context_params());
+  auto wait_until_full = [](KeyPool& pool, size_t capacity) {
+    const auto deadline = absl::Now() + absl::Minutes(1);
+    while (pool.size() < capacity && absl::Now() < deadline) {
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+    return pool.size();
+  };
+
+  std::set<string> galois_keys;
+  {
+    KeyPool pool(sc, 2);
+    EXPECT_EQ(wait_until_full(pool, 2), 2);
+    // every key pair is handed out once, and the pool refills behind pop,
+    // and then generates inline when it runs dry
+    for (size_t i = 0; i < 4; i++) {
+      EXPECT_TRUE(galois_keys.insert(pool.pop().galois_keys.galois_string)
+                      .second);
+    }
+    EXPECT_EQ(wait_until_full(pool, 2), 2);
+  }
+
+  // without a background thread, every pop generates inline
+  {
+    KeyPool pool(sc, 0);
+    for (size_t i = 0; i < 2; i++) {
+      EXPECT_TRUE(galois_keys.insert(pool.pop().galois_keys.galois_string)
+                      .second);
+    }
+    EXPECT_EQ(pool.size(), 0);
+  }
+
+  // shutting down joins the background thread while it is still generating
+  { KeyPool pool(sc, 4); }
+}
+
+TEST(FastPIR, StreamedQuery) {
+  const size_t db_rows = 2 * POLY_MODULUS_DEGREE;
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  const pir_index_t index = POLY_MODULUS_DEGREE + 5;
+  const auto value = random_value(gen);
+  server.allocate_to_max(db_rows);
+  server.set_value(index, value);
+
+  auto [query, ticket] = client.query(index, db_rows);
+  auto reader = server.query_stream_reader();
+  size_t ciphertext_chunks = 0;
+  query.serialize_to_chunks(true, [&](FastPIRChunkType type, string chunk) {
+    EXPECT_LE(chunk.size(), STREAMING_CHUNK_SIZE);
+    if (type == FastPIRChunkType::ciphertext) {
+      ciphertext_chunks++;
+    }
+    reader.add_chunk(type, chunk);
+  });
+  EXPECT_EQ(ciphertext_chunks, 2);
+  EXPECT_TRUE(reader.has_galois_keys());
+
+  auto answer = server.answer(reader.finish());
+  ASSERT_TRUE(answer.ok()) << answer.status();
+  auto client_answer = client.answer_from_string(answer->serialize_to_string());
+  EXPECT_EQ(client.decode(client_answer, ticket).value(), value);
+}
+
+TEST(FastPIR, RejectsOversizedStreamedQuery) {
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  // more galois key bytes than any full set of keys
+  auto reader = server.query_stream_reader();
+  const string junk(STREAMING_CHUNK_SIZE, 'x');
+  bool rejected = false;
+  for (size_t i = 0; i < 1'000 && !rejected; i++) {
+    try {
+      reader.add_chunk(FastPIRChunkType::galois_keys, junk);
+    } catch (const std::invalid_argument&) {
+      rejected = true;
+    }
+  }
+  EXPECT_TRUE(rejected);
+
+  // more ciphertexts than a database of CLIENT_DB_ROWS rows has seal rows
+  auto query = client.query(0, POLY_MODULUS_DEGREE).first;
+  string ciphertext;
+  query.serialize_to_chunks(false, [&](FastPIRChunkType, string chunk) {
+    ciphertext = std::move(chunk);
+  });
+  auto ciphertext_reader = server.query_stream_reader();
+  const size_t max_ciphertexts =
+      CEIL_DIV(static_cast<size_t>(CLIENT_DB_ROWS), POLY_MODULUS_DEGREE);
+  for (size_t i = 0; i < max_ciphertexts; i++) {
+    ciphertext_reader.add_chunk(FastPIRChunkType::ciphertext, ciphertext);
+  }
+  EXPECT_THROW(
+      ciphertext_reader.add_chunk(FastPIRChunkType::ciphertext, ciphertext),
+      std::invalid_argument);
+}
+
+TEST(FastPIR, RejectsTruncatedQuery) {
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  auto query = client.query(0, 3 * POLY_MODULUS_DEGREE).first;
+  const auto s = query.serialize_to_string_without_keys();
+  EXPECT_EQ(server.query_from_string_without_keys(s).query.size(), 3);
+  EXPECT_ANY_THROW(server.query_from_string_without_keys(
+      std::string_view(s).substr(0, s.size() - 1)));
+}
+
+TEST(FastPIR, CompactAnswer) {
+  const size_t db_rows = 2 * POLY_MODULUS_DEGREE;
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  for (pir_index_t index : {size_t{1}, POLY_MODULUS_DEGREE + 2049}) {
+    auto [query, ticket] = client.query(index, db_rows);
+    auto answer =
+        server.answer(server.query_from_string(query.serialize_to_string()));
+    ASSERT_TRUE(answer.ok()) << answer.status();
+    const auto compact = server.answer_to_compact_string(*answer);
+    EXPECT_LT(compact.size(), answer->serialize_to_string().size());
+    auto client_answer = client.answer_from_compact_string(compact);
+    EXPECT_EQ(client.decode(client_answer, ticket).value(), values.at(index));
+  }
+}
+
+TEST(FastPIR, OverlappingQueriesForSameIndex) {
+  const size_t db_rows = POLY_MODULUS_DEGREE;
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  const pir_index_t index = 7;
+  const auto old_value = random_value(gen);
+  server.allocate_to_max(db_rows);
+  server.set_value(index, old_value);
+
+  // the second query is made before the first one is answered, and the value
+  // changes in between
+  auto [first_query, first_ticket] = client.query(index, db_rows);
+  auto [second_query, second_ticket] = client.query(index, db_rows);
+  auto first_answer = server.answer(
+      server.query_from_string(first_query.serialize_to_string()));
+  ASSERT_TRUE(first_answer.ok()) << first_answer.status();
+  const auto new_value = random_value(gen);
+  server.set_value(index, new_value);
+  auto second_answer = server.answer(
+      server.query_from_string(second_query.serialize_to_string()));
+  ASSERT_TRUE(second_answer.ok()) << second_answer.status();
+
+  auto second_client_answer =
+      client.answer_from_string(second_answer->serialize_to_string());
+  EXPECT_EQ(client.decode(second_client_answer, second_ticket).value(),
+            new_value);
+  auto first_client_answer =
+      client.answer_from_string(first_answer->serialize_to_string());
+  EXPECT_EQ(client.decode(first_client_answer, first_ticket).value(),
+            old_value);
+  // a ticket can only be decoded once
+  EXPECT_EQ(client.decode(first_client_answer, first_ticket).status().code(),
+            absl::StatusCode::kNotFound);
+}
+
+TEST(FastPIR, QueryTicketLimits) {
+  FastPIRServer server(create_context_params(), 2);
+  FastPIRClient client;
+  server.allocate_to_max(POLY_MODULUS_DEGREE);
+  client.set_query_ticket_limits(2, absl::Hours(1));
+
+  auto answer_for = [&](FastPIRClient::pir_query_t& query) {
+    auto answer =
+        server.answer(server.query_from_string(query.serialize_to_string()));
+    EXPECT_TRUE(answer.ok()) << answer.status();
+    return client.answer_from_string(answer->serialize_to_string());
+  };
+
+  // the third query takes the slot of the first one, which expires first
+  auto [query0, ticket0] = client.query(0, POLY_MODULUS_DEGREE);
+  auto [query1, ticket1] = client.query(1, POLY_MODULUS_DEGREE);
+  auto [query2, ticket2] = client.query(2, POLY_MODULUS_DEGREE);
+  EXPECT_EQ(client.decode(answer_for(query0), ticket0).status().code(),
+            absl::StatusCode::kNotFound);
+  EXPECT_TRUE(client.decode(answer_for(query1), ticket1).ok());
+  EXPECT_TRUE(client.decode(answer_for(query2), ticket2).ok());
+
+  client.set_query_ticket_limits(2, absl::ZeroDuration());
+  auto [query3, ticket3] = client.query(3, POLY_MODULUS_DEGREE);
+  EXPECT_EQ(client.decode(answer_for(query3), ticket3).status().code(),
+            absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(FastPIR, BatchLayout) {
+  BatchPIRLayout layout(BATCH_PIR_BUCKETS);
+  // positions are dense, and do not depend on how far the layout is extended
+  vector<size_t> bucket_rows(BATCH_PIR_BUCKETS, 0);
+  for (pir_index_t index = 0; index < 1000; index++) {
+    const auto buckets = layout.buckets(index);
+    EXPECT_GE(buckets.size(), 1);
+    EXPECT_LE(buckets.size(), BATCH_PIR_HASH_FUNCTIONS);
+    for (auto b : buckets) {
+      EXPECT_EQ(layout.position(index, b), bucket_rows[b]++);
+    }
+  }
+  for (size_t b = 0; b < BATCH_PIR_BUCKETS; b++) {
+    EXPECT_EQ(layout.bucket_rows(b, 1000), bucket_rows[b]);
+  }
+}
+
+TEST(FastPIR, BatchQuery) {
+  const size_t db_rows = POLY_MODULUS_DEGREE + 1;
+  FastPIRBatchServer server(create_context_params(), 2);
+  FastPIRClient client;
+
+  absl::BitGen gen;
+  vector<pir_value_t> values;
+  for (size_t i = 0; i < db_rows; i++) {
+    values.push_back(random_value(gen));
+    server.set_value(i, values.back());
+  }
+
+  const vector<pir_index_t> indices = {0, 17, 2048, 4000, POLY_MODULUS_DEGREE};
+  auto query = client.batch_query(indices, db_rows);
+  ASSERT_TRUE(query.ok()) << query.status();
+  auto& [batch_query, ticket] = query.value();
+  auto answer = server.answer(
+      server.query_from_string(batch_query.serialize_to_string()));
+  ASSERT_TRUE(answer.ok()) << answer.status();
+  const auto batch_answer =
+      client.batch_answer_from_string(answer->serialize_to_string());
+  const auto decoded = client.batch_decode(batch_answer, ticket, indices);
+  ASSERT_TRUE(decoded.ok()) << decoded.status();
+  for (size_t i = 0; i < indices.size(); i++) {
+    EXPECT_EQ(decoded->at(i), values.at(indices[i]));
+  }
+  // a batch ticket is decoded once, and only by batch_decode
+  EXPECT_FALSE(client.batch_decode(batch_answer, ticket, indices).ok());
+  auto other = client.batch_query(indices, db_rows);
+  ASSERT_TRUE(other.ok()) << other.status();
+  EXPECT_FALSE(client.decode(FastPIRAnswer{}, other->second).ok());
+}
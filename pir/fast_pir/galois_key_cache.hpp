@@ -0,0 +1,114 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <seal/seal.h>
+
+#include <list>
+#include <mutex>
+
+#include "asphr/asphr.hpp"
+
+// the keys a client has registered with the server
+struct RegisteredKeys {
+  seal::GaloisKeys galois_keys;
+  // only needed for compressed queries
+  optional<seal::RelinKeys> relin_keys;
+};
+
+// GaloisKeyCache holds the deserialized galois keys (and, for clients that use
+// compressed queries, relinearization keys) of registered clients, keyed by
+// client identity. Galois keys are several MB, so clients register
+// them once and then send key-less queries, which saves both the upload and
+// the deserialization on every query.
+//
+// The cache is thread safe. It holds at most capacity clients, and evicts the
+// least recently used one when it is full. An evicted client gets a NotFound
+// error on its next key-less query, and has to register again.
+class GaloisKeyCache {
+ public:
+  GaloisKeyCache(seal::SEALContext sc, size_t capacity)
+      : sc(sc), capacity(capacity) {
+    assert(capacity > 0);
+  }
+
+  // replaces any keys previously registered for client_id. the relin keys
+  // are optional.
+  auto register_keys(const string& client_id,
+                     const string& serialized_galois_keys,
+                     const string& serialized_relin_keys = "")
+      -> asphr::Status {
+    auto keys = make_shared<RegisteredKeys>();
+    try {
+      auto g_stream = std::stringstream(serialized_galois_keys);
+      keys->galois_keys.load(sc, g_stream);
+      if (!serialized_relin_keys.empty()) {
+        auto r_stream = std::stringstream(serialized_relin_keys);
+        keys->relin_keys.emplace();
+        keys->relin_keys->load(sc, r_stream);
+      }
+    } catch (const std::exception& e) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat("failed to load keys: ", e.what()));
+    }
+
+    lock_guard<std::mutex> l(mutex);
+    erase(client_id);
+    lru.push_front(client_id);
+    entries.insert({client_id, Entry{std::move(keys), lru.begin()}});
+    while (entries.size() > capacity) {
+      const auto oldest = lru.back();
+      erase(oldest);
+    }
+    return absl::OkStatus();
+  }
+
+  // returns nullptr if no keys are registered for client_id. the keys stay
+  // valid even if they are evicted or replaced while in use.
+  auto get(const string& client_id) -> shared_ptr<const RegisteredKeys> {
+    lock_guard<std::mutex> l(mutex);
+    auto it = entries.find(client_id);
+    if (it == entries.end()) {
+      return nullptr;
+    }
+    lru.splice(lru.begin(), lru, it->second.lru_position);
+    return it->second.keys;
+  }
+
+  auto remove(const string& client_id) -> void {
+    lock_guard<std::mutex> l(mutex);
+    erase(client_id);
+  }
+
+  auto size() -> size_t {
+    lock_guard<std::mutex> l(mutex);
+    return entries.size();
+  }
+
+ private:
+  struct Entry {
+    shared_ptr<const RegisteredKeys> keys;
+    std::list<string>::iterator lru_position;
+  };
+
+  seal::SEALContext sc;
+  const size_t capacity;
+
+  // protects everything below
+  std::mutex mutex;
+  // most recently used first
+  std::list<string> lru;
+  asphr::unordered_map<string, Entry> entries;
+
+  // requires mutex to be held
+  auto erase(const string& client_id) -> void {
+    auto it = entries.find(client_id);
+    if (it != entries.end()) {
+      lru.erase(it->second.lru_position);
+      entries.erase(it);
+    }
+  }
+};
@@ -0,0 +1,515 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#include "pir_database.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <system_error>
+
+namespace {
+// the file starts with a header page, so that the blocks are page aligned. the
+// integers are little endian, like the hosts we run on.
+constexpr size_t HEADER_SIZE = 4096;
+constexpr char MAGIC[8] = {'A', 'S', 'P', 'H', 'R', 'P', 'I', 'R'};
+// version 2 pads the columns to whole cache lines
+constexpr uint32_t VERSION = 2;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t plain_bits;
+  uint32_t columns;
+  uint32_t block_rows;
+  uint64_t rows;
+  // of all the fields above
+  uint64_t checksum;
+};
+static_assert(sizeof(FileHeader) <= HEADER_SIZE);
+static_assert(std::endian::native == std::endian::little,
+              "the database file format is little endian");
+
+auto mix(uint64_t x) -> uint64_t {
+  x = (x ^ (x >> 30)) * 0xBF58'476D'1CE4'E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D0'49BB'1331'11EBULL;
+  return x ^ (x >> 31);
+}
+
+auto header_checksum(const FileHeader& header) -> uint64_t {
+  uint64_t magic;
+  std::memcpy(&magic, header.magic, sizeof(magic));
+  uint64_t h = mix(magic);
+  h = mix(h ^ header.version);
+  h = mix(h ^ header.plain_bits);
+  h = mix(h ^ header.columns);
+  h = mix(h ^ header.block_rows);
+  return mix(h ^ header.rows);
+}
+
+// mix(0) == 0, so a row of 0s, which is what new rows are, has checksum 0.
+auto row_checksum(std::span<const uint64_t> coefficients) -> uint64_t {
+  uint64_t h = 0;
+  for (const auto c : coefficients) {
+    h = mix(h ^ c);
+  }
+  return h;
+}
+
+[[noreturn]] auto throw_errno(const char* what) -> void {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// one row in the log. the checksum covers index and value, so that a record
+// that was torn by a crash is recognized, and ends the log.
+struct LogRecord {
+  uint64_t index;
+  pir_value_t value;
+  uint64_t checksum;
+};
+static_assert(sizeof(LogRecord) == 2 * sizeof(uint64_t) + MESSAGE_SIZE);
+
+auto log_record_checksum(const LogRecord& record) -> uint64_t {
+  uint64_t h = mix(record.index);
+  for (size_t i = 0; i < MESSAGE_SIZE; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, record.value.data() + i, sizeof(word));
+    h = mix(h ^ word);
+  }
+  return h;
+}
+
+// the checkpoint thread runs this often, or as soon as the log has this many
+// bytes, whichever comes first
+constexpr auto CHECKPOINT_INTERVAL = std::chrono::seconds(10);
+constexpr size_t CHECKPOINT_LOG_BYTES = 16 << 20;
+
+auto sync(const void* begin, size_t bytes) noexcept(false) -> void {
+  // msync wants a page aligned address
+  static const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto address = reinterpret_cast<uintptr_t>(begin);
+  const auto aligned = address & ~(page_size - 1);
+  if (msync(reinterpret_cast<void*>(aligned), bytes + (address - aligned),
+            MS_SYNC) != 0) {
+    throw_errno("msync");
+  }
+}
+
+// so that files created or renamed in the directory survive a crash
+auto sync_directory(const string& path) noexcept(false) -> void {
+  const auto directory = std::filesystem::path(path).parent_path();
+  const int fd = ::open(directory.empty() ? "." : directory.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw_errno("open directory");
+  }
+  const int result = fsync(fd);
+  close(fd);
+  if (result != 0) {
+    throw_errno("fsync directory");
+  }
+}
+
+auto open_log(const string& path) noexcept(false) -> int {
+  const int fd =
+      ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw_errno("open log");
+  }
+  return fd;
+}
+
+// the records of the log at path, up to the first torn one. no records if
+// there is no log.
+auto read_log(const string& path) noexcept(false) -> vector<LogRecord> {
+  vector<LogRecord> records;
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return records;
+    }
+    throw_errno("open log");
+  }
+  LogRecord record;
+  while (read(fd, &record, sizeof(record)) == sizeof(record) &&
+         record.checksum == log_record_checksum(record)) {
+    records.push_back(record);
+  }
+  close(fd);
+  return records;
+}
+}  // namespace
+
+struct PIRDatabase::File {
+  string path;
+  int fd = -1;
+  void* mapping = nullptr;
+  size_t mapping_size = 0;
+  // held while the mapping is replaced, and while it is synced
+  std::mutex mapping_mutex;
+  // one checkpoint at a time
+  std::mutex checkpoint_mutex;
+
+  // protects everything below
+  std::mutex mutex;
+  std::condition_variable cv;
+  int log_fd = -1;
+  size_t log_bytes = 0;
+  bool stopping = false;
+  std::thread checkpointer;
+
+  ~File() {
+    if (checkpointer.joinable()) {
+      {
+        lock_guard<std::mutex> l(mutex);
+        stopping = true;
+      }
+      cv.notify_all();
+      checkpointer.join();
+      try {
+        checkpoint();
+        // a clean close leaves no log behind
+        if (log_bytes == 0) {
+          unlink(log_path().c_str());
+        }
+      } catch (const std::system_error& e) {
+        // the log stays, and is replayed by the next open
+        ASPHR_LOG_ERR("Final database checkpoint failed.", error, e.what());
+      }
+    }
+    if (mapping != nullptr) {
+      munmap(mapping, mapping_size);
+    }
+    if (log_fd >= 0) {
+      close(log_fd);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  auto log_path() const -> string { return path + ".log"; }
+  auto old_log_path() const -> string { return path + ".log.old"; }
+
+  // the caller holds mutex, and writes the row into the mapping before it
+  // lets go of it, so that a checkpoint never drops a log with a row that is
+  // not in the mapping yet.
+  auto append(pir_index_t index, const pir_value_t& value) noexcept(false)
+      -> void {
+    LogRecord record{index, value, 0};
+    record.checksum = log_record_checksum(record);
+    if (write(log_fd, &record, sizeof(record)) != sizeof(record)) {
+      throw_errno("write log");
+    }
+    if (fdatasync(log_fd) != 0) {
+      throw_errno("fdatasync log");
+    }
+    log_bytes += sizeof(record);
+    if (log_bytes >= CHECKPOINT_LOG_BYTES) {
+      cv.notify_all();
+    }
+  }
+
+  // writes the mapping back to the file, and drops the log. new writes go to
+  // a new log in the meantime, so they do not wait for it. if a checkpoint
+  // fails after the switch, the old log stays, and the next one retries it.
+  auto checkpoint() noexcept(false) -> void {
+    lock_guard<std::mutex> c(checkpoint_mutex);
+    {
+      lock_guard<std::mutex> l(mutex);
+      if (log_bytes == 0 && !std::filesystem::exists(old_log_path())) {
+        return;
+      }
+      if (log_bytes > 0 && !std::filesystem::exists(old_log_path())) {
+        if (rename(log_path().c_str(), old_log_path().c_str()) != 0) {
+          throw_errno("rename log");
+        }
+        int new_log_fd = -1;
+        try {
+          new_log_fd = open_log(log_path());
+        } catch (const std::system_error&) {
+          // keep appending to the current log, under its old name
+          rename(old_log_path().c_str(), log_path().c_str());
+          throw;
+        }
+        close(std::exchange(log_fd, new_log_fd));
+        log_bytes = 0;
+        sync_directory(path);
+      }
+    }
+    {
+      lock_guard<std::mutex> l(mapping_mutex);
+      sync(mapping, mapping_size);
+    }
+    if (unlink(old_log_path().c_str()) != 0) {
+      throw_errno("unlink log");
+    }
+  }
+
+  auto checkpoint_loop() -> void {
+    std::unique_lock<std::mutex> l(mutex);
+    while (!stopping) {
+      cv.wait_for(l, CHECKPOINT_INTERVAL, [this] {
+        return stopping || log_bytes >= CHECKPOINT_LOG_BYTES;
+      });
+      if (stopping) {
+        return;
+      }
+      l.unlock();
+      try {
+        checkpoint();
+      } catch (const std::system_error& e) {
+        ASPHR_LOG_ERR("Database checkpoint failed.", error, e.what());
+      }
+      l.lock();
+    }
+  }
+};
+
+PIRDatabase::PIRDatabase(size_t block_rows, int plain_bits)
+    : block_rows(block_rows),
+      coefficient_bits(plain_bits),
+      num_columns(CEIL_DIV(MESSAGE_SIZE_BITS, plain_bits)),
+      column_stride(CEIL_DIV(block_rows * sizeof(uint64_t), COLUMN_ALIGNMENT) *
+                    COLUMN_ALIGNMENT / sizeof(uint64_t)) {
+  assert(block_rows > 0);
+  assert(plain_bits >= 1 && plain_bits < 64);
+}
+
+PIRDatabase::PIRDatabase(PIRDatabase&& other) noexcept
+    : block_rows(other.block_rows),
+      coefficient_bits(other.coefficient_bits),
+      num_columns(other.num_columns),
+      column_stride(other.column_stride),
+      num_rows(other.num_rows),
+      memory(std::move(other.memory)),
+      file(std::move(other.file)),
+      data(std::exchange(other.data, nullptr)) {
+  other.num_rows = 0;
+}
+
+PIRDatabase::~PIRDatabase() = default;
+
+auto PIRDatabase::open(const string& path, size_t block_rows, int plain_bits)
+    -> asphr::StatusOr<PIRDatabase> {
+  PIRDatabase db(block_rows, plain_bits);
+  db.file = make_unique<File>();
+  db.file->path = path;
+  const int fd = db.file->fd =
+      ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return asphr::InvalidArgumentError(
+        asphr::StrCat("failed to open ", path, ": ", strerror(errno)));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return absl::InternalError(
+        asphr::StrCat("failed to stat ", path, ": ", strerror(errno)));
+  }
+
+  try {
+    if (st.st_size == 0) {
+      // a new file
+      if (ftruncate(fd, HEADER_SIZE) != 0) {
+        throw_errno("ftruncate");
+      }
+      db.map_blocks(0);
+      db.write_header();
+      db.recover();
+      return db;
+    }
+
+    FileHeader header;
+    if (static_cast<size_t>(st.st_size) < HEADER_SIZE ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      return absl::DataLossError(
+          asphr::StrCat(path, " is too short to be a database file"));
+    }
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+      return asphr::InvalidArgumentError(
+          asphr::StrCat(path, " is not a database file"));
+    }
+    if (header.checksum != header_checksum(header)) {
+      return absl::DataLossError(
+          asphr::StrCat("the header of ", path, " is corrupt"));
+    }
+    if (header.version != VERSION) {
+      return absl::FailedPreconditionError(asphr::StrCat(
+          path, " has version ", header.version, ", expected ", VERSION));
+    }
+    if (header.plain_bits != static_cast<uint32_t>(plain_bits) ||
+        header.columns != db.num_columns || header.block_rows != block_rows) {
+      return absl::FailedPreconditionError(asphr::StrCat(
+          path, " was written with ", header.plain_bits, " plain bits, ",
+          header.columns, " columns and ", header.block_rows,
+          " rows per block"));
+    }
+    db.num_rows = header.rows;
+    const size_t expected_size =
+        HEADER_SIZE + db.blocks() * db.block_size() * sizeof(uint64_t);
+    if (static_cast<size_t>(st.st_size) < expected_size) {
+      return absl::DataLossError(
+          asphr::StrCat(path, " is truncated: it has ", st.st_size,
+                        " bytes, expected ", expected_size));
+    }
+    db.map_blocks(db.blocks());
+    db.recover();
+  } catch (const std::system_error& e) {
+    return absl::InternalError(
+        asphr::StrCat("failed to map ", path, ": ", e.what()));
+  }
+  return db;
+}
+
+auto PIRDatabase::allocate_to_max(size_t rows) noexcept(false) -> void {
+  if (rows <= num_rows) {
+    return;
+  }
+  const size_t old_blocks = blocks();
+  const size_t new_blocks = CEIL_DIV(rows, block_rows);
+  if (!is_file_backed()) {
+    num_rows = rows;
+    memory.resize(new_blocks * block_size(), 0);
+    data = memory.data();
+    return;
+  }
+  // the new blocks must be on disk before the header says they exist
+  if (new_blocks > old_blocks) {
+    const size_t size =
+        HEADER_SIZE + new_blocks * block_size() * sizeof(uint64_t);
+    if (ftruncate(file->fd, static_cast<off_t>(size)) != 0) {
+      throw_errno("ftruncate");
+    }
+    if (fsync(file->fd) != 0) {
+      throw_errno("fsync");
+    }
+    map_blocks(new_blocks);
+  }
+  num_rows = rows;
+  write_header();
+}
+
+auto PIRDatabase::set_value(pir_index_t index,
+                            const pir_value_t& value) noexcept(false) -> void {
+  allocate_to_max(static_cast<size_t>(index) + 1);
+  if (!is_file_backed()) {
+    write_row(index, value);
+    return;
+  }
+  // the row must be in the log before any of it can reach the file, and in
+  // the mapping before a checkpoint can drop the log
+  lock_guard<std::mutex> l(file->mutex);
+  file->append(index, value);
+  write_row(index, value);
+}
+
+auto PIRDatabase::checkpoint() noexcept(false) -> void {
+  if (is_file_backed()) {
+    file->checkpoint();
+  }
+}
+
+auto PIRDatabase::write_row(pir_index_t index, const pir_value_t& value)
+    -> void {
+  // the last coefficient is padded with 0s on the right
+  vector<unsigned char> packed(
+      asphr::packed_size(num_columns, coefficient_bits), 0);
+  std::copy(value.begin(), value.end(), packed.begin());
+  vector<uint64_t> coefficients(num_columns);
+  asphr::unpack_lsb_bits(packed, coefficient_bits, coefficients);
+  for (size_t j = 0; j < num_columns; j++) {
+    data[position(index, j)] = coefficients[j];
+  }
+  data[position(index, num_columns)] = row_checksum(coefficients);
+}
+
+auto PIRDatabase::get_value(pir_index_t index) const -> pir_value_t {
+  assert(index < num_rows);
+  vector<uint64_t> coefficients(num_columns);
+  for (size_t j = 0; j < num_columns; j++) {
+    coefficients[j] = data[position(index, j)];
+  }
+  vector<unsigned char> packed(
+      asphr::packed_size(num_columns, coefficient_bits));
+  asphr::pack_lsb_bits(coefficients, coefficient_bits, packed);
+  pir_value_t value;
+  std::copy_n(packed.begin(), MESSAGE_SIZE, value.begin());
+  return value;
+}
+
+auto PIRDatabase::verify() const -> asphr::Status {
+  vector<uint64_t> coefficients(num_columns);
+  for (size_t i = 0; i < num_rows; i++) {
+    for (size_t j = 0; j < num_columns; j++) {
+      coefficients[j] = data[position(i, j)];
+    }
+    if (data[position(i, num_columns)] != row_checksum(coefficients)) {
+      return absl::DataLossError(asphr::StrCat("row ", i, " is corrupt"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+auto PIRDatabase::map_blocks(size_t blocks) noexcept(false) -> void {
+  const size_t size = HEADER_SIZE + blocks * block_size() * sizeof(uint64_t);
+  void* new_mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+  if (new_mapping == MAP_FAILED) {
+    throw_errno("mmap");
+  }
+  lock_guard<std::mutex> l(file->mapping_mutex);
+  if (file->mapping != nullptr) {
+    munmap(file->mapping, file->mapping_size);
+  }
+  file->mapping = new_mapping;
+  file->mapping_size = size;
+  data = reinterpret_cast<uint64_t*>(static_cast<char*>(new_mapping) +
+                                     HEADER_SIZE);
+}
+
+auto PIRDatabase::write_header() noexcept(false) -> void {
+  FileHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.plain_bits = static_cast<uint32_t>(coefficient_bits);
+  header.columns = static_cast<uint32_t>(num_columns);
+  header.block_rows = static_cast<uint32_t>(block_rows);
+  header.rows = num_rows;
+  header.checksum = header_checksum(header);
+  std::memcpy(file->mapping, &header, sizeof(header));
+  sync(file->mapping, HEADER_SIZE);
+}
+
+auto PIRDatabase::recover() noexcept(false) -> void {
+  // the old log is older than the current one, if both are there
+  size_t replayed = 0;
+  for (const auto& log : {file->old_log_path(), file->log_path()}) {
+    for (const auto& record : read_log(log)) {
+      const auto index = static_cast<pir_index_t>(record.index);
+      allocate_to_max(static_cast<size_t>(index) + 1);
+      write_row(index, record.value);
+      replayed++;
+    }
+  }
+  if (replayed > 0) {
+    ASPHR_LOG_INFO("Replayed the database log.", rows, replayed);
+    sync(file->mapping, file->mapping_size);
+  }
+  for (const auto& log : {file->old_log_path(), file->log_path()}) {
+    if (unlink(log.c_str()) != 0 && errno != ENOENT) {
+      throw_errno("unlink log");
+    }
+  }
+  file->log_fd = open_log(file->log_path());
+  sync_directory(file->path);
+  file->checkpointer = std::thread([f = file.get()] { f->checkpoint_loop(); });
+}
@@ -0,0 +1,165 @@
+//
+// Copyright 2022 Anysphere, Inc.
+// SPDX-License-Identifier: GPL-3.0-only
+//
+
+#pragma once
+
+#include <new>
+#include <span>
+
+#include "asphr/asphr.hpp"
+#include "fast_pir_config.hpp"
+
+// PIRDatabase stores the rows of the PIR database already split into the
+// coefficients of plain_bits bits each that the plaintexts are made of, which
+// is the PLAIN_BITS and SEAL_DB_COLUMNS of the parameter set. The rows are
+// grouped into blocks of block_rows rows (the number of slots of a plaintext,
+// POLY_MODULUS_DEGREE by default), and every block stores its coefficients
+// column by column, padded with 0s to block_rows rows. So the coefficients of
+// plaintext (i, j) are the contiguous column j of block i, which can be handed
+// to the batch encoder as is, instead of being gathered bit by bit from 1 KB
+// rows. Every block also stores a checksum of each of its rows. Every column
+// starts on a cache line (see COLUMN_ALIGNMENT): the columns are padded to a
+// multiple of it, and the blocks are allocated aligned to it.
+//
+// The blocks live either in memory, or in a file that is mapped into memory
+// (see open). The file is a header page followed by the blocks, in exactly the
+// layout above, so a server can restart without re-reading or re-splitting any
+// rows.
+//
+// Since a row is spread over every column of its block, writing one back to
+// the file touches one page per column. So a file-backed database makes each
+// write durable by appending the row to a write-ahead log next to the file
+// (<path>.log), and a background thread writes the dirty pages of the mapping
+// back every few seconds, after which the log is dropped.
+//
+// Rows are split into coefficients on write and put back together on read.
+// Reads may happen from any number of threads at once, but not concurrently
+// with a write. Growing the database invalidates the spans returned by
+// column_block.
+class PIRDatabase {
+ public:
+  // in bytes, a cache line
+  static constexpr size_t COLUMN_ALIGNMENT = 64;
+
+  // an empty database in memory
+  explicit PIRDatabase(size_t block_rows = POLY_MODULUS_DEGREE,
+                       int plain_bits = PLAIN_BITS);
+
+  // opens the database file at path, or creates an empty one if there is no
+  // file. the file is mapped, not read, so this takes the same time no matter
+  // how large the database is, and the os pages the coefficients in as they are
+  // used. the rows are not checked, see verify. fails if the file is not a
+  // database file, or was written with a different block_rows or plain_bits.
+  //
+  // writes to a file-backed database are on disk, in the log, when they
+  // return, and throw std::system_error if they fail. open replays the rows
+  // the log has, so a crash loses at most the write that was in progress.
+  static auto open(const string& path, size_t block_rows = POLY_MODULUS_DEGREE,
+                   int plain_bits = PLAIN_BITS)
+      -> asphr::StatusOr<PIRDatabase>;
+
+  PIRDatabase(PIRDatabase&& other) noexcept;
+  PIRDatabase(const PIRDatabase&) = delete;
+  auto operator=(const PIRDatabase&) -> PIRDatabase& = delete;
+  ~PIRDatabase();
+
+  auto rows() const -> size_t { return num_rows; }
+
+  auto plain_bits() const -> int { return coefficient_bits; }
+
+  // number of coefficients per row
+  auto columns() const -> size_t { return num_columns; }
+
+  // number of blocks, the last one possibly partial
+  auto blocks() const -> size_t { return CEIL_DIV(num_rows, block_rows); }
+
+  auto is_file_backed() const -> bool { return file != nullptr; }
+
+  // grows the database to at least rows rows. new rows are all 0s.
+  auto allocate_to_max(size_t rows) noexcept(false) -> void;
+
+  auto set_value(pir_index_t index, const pir_value_t& value) noexcept(false)
+      -> void;
+
+  auto get_value(pir_index_t index) const -> pir_value_t;
+
+  // writes the rows in the log back to the file, and drops the log. the
+  // background thread does this every few seconds anyway. may run
+  // concurrently with writes. does nothing for a database in memory.
+  auto checkpoint() noexcept(false) -> void;
+
+  // coefficient column of rows [block * block_rows, (block + 1) * block_rows)
+  auto column_block(size_t column, size_t block) const
+      -> std::span<const uint64_t> {
+    assert(column < num_columns);
+    assert(block < blocks());
+    return {data + block * block_size() + column * column_stride, block_rows};
+  }
+
+  // checks the checksum of every row. reads the whole database.
+  auto verify() const -> asphr::Status;
+
+ private:
+  const size_t block_rows;
+  const int coefficient_bits;
+  const size_t num_columns;
+  // in uint64s: block_rows, padded to a multiple of COLUMN_ALIGNMENT bytes
+  const size_t column_stride;
+  size_t num_rows = 0;
+
+  // the default allocator only aligns to 16 bytes
+  template <typename T>
+  struct AlignedAllocator {
+    using value_type = T;
+    static constexpr std::align_val_t ALIGNMENT{COLUMN_ALIGNMENT};
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    auto allocate(size_t n) -> T* {
+      return static_cast<T*>(::operator new(n * sizeof(T), ALIGNMENT));
+    }
+    auto deallocate(T* p, size_t) -> void { ::operator delete(p, ALIGNMENT); }
+
+    template <typename U>
+    auto operator==(const AlignedAllocator<U>&) const -> bool {
+      return true;
+    }
+  };
+
+  // the blocks, if the database is in memory
+  vector<uint64_t, AlignedAllocator<uint64_t>> memory;
+  // the file, its mapping and its log, if the database is file-backed. on the
+  // heap, since the checkpoint thread uses it.
+  struct File;
+  unique_ptr<File> file;
+
+  // the first block, in memory or in the mapping
+  uint64_t* data = nullptr;
+
+  // in uint64s. a block is its coefficient columns, followed by the row
+  // checksums.
+  auto block_size() const -> size_t {
+    return (num_columns + 1) * column_stride;
+  }
+
+  // the position in data of coefficient column of row index. the checksum is
+  // column num_columns.
+  auto position(size_t index, size_t column) const -> size_t {
+    return index / block_rows * block_size() + column * column_stride +
+           index % block_rows;
+  }
+
+  // splits value into the coefficients of row index
+  auto write_row(pir_index_t index, const pir_value_t& value) -> void;
+
+  // file-backed only
+  auto map_blocks(size_t blocks) noexcept(false) -> void;
+  auto write_header() noexcept(false) -> void;
+  // applies the rows in the logs left by the last process, and starts a new
+  // log
+  auto recover() noexcept(false) -> void;
+};